@@ -35,4 +35,52 @@ struct lru_cache {
 
 struct cache *lru_cache_create(size_t capacity);
 
+/*
+ * Plaintext data block cache. Lookups copy the block out, so an entry may be
+ * evicted or invalidated right after get() returns. A reader takes the
+ * generation of a key before it starts looking the block up elsewhere and
+ * passes it to put(); an invalidate() in between makes that put() a no-op,
+ * so a racing write can never be shadowed by the data it replaced.
+ */
+#define DEFAULT_DATA_CACHE_BLOCKS 16384
+#define BLOCK_CACHE_GEN_SLOTS 256
+
+struct block_cache {
+	int (*get)(struct block_cache *bc, uint64_t key, void *data_out);
+	void (*put)(struct block_cache *bc, uint64_t key, void *data,
+		    uint64_t gen);
+	uint64_t (*generation)(struct block_cache *bc, uint64_t key);
+	void (*invalidate)(struct block_cache *bc, uint64_t key);
+	void (*destroy)(struct block_cache *bc);
+};
+
+enum twoq_queue { TWOQ_A1IN, TWOQ_A1OUT, TWOQ_AM };
+
+struct twoq_cache_node {
+	uint64_t key;
+	void *data;
+	enum twoq_queue queue;
+	struct list_head list;
+};
+
+/*
+ * 2Q replacement: new blocks enter the A1in FIFO and only get promoted to
+ * the Am LRU when they are referenced again after leaving A1in, which is
+ * remembered by a data-less ghost entry on A1out. A sequential scan thus
+ * only ever cycles through A1in and cannot flush the hot set.
+ */
+struct twoq_cache {
+	struct block_cache block_cache;
+
+	struct mutex lock;
+	size_t block_size;
+	size_t capacity, kin, kout;
+	size_t nr_in, nr_out, nr_am;
+	struct radix_tree_root root;
+	struct list_head a1in, a1out, am;
+	atomic64_t gens[BLOCK_CACHE_GEN_SLOTS];
+};
+
+struct block_cache *twoq_cache_create(size_t capacity, size_t block_size);
+
 #endif
@@ -24,12 +24,35 @@
 #define RFC_AES_GCM_AUTH_SIZE 16
 
 #define AEAD_MSG_NR_PART 4
+#define AEAD_ENGINE_QUEUE_DEPTH 64
+
+/*
+ * One block of an encrypt_many/decrypt_many batch. The engine fills in @err
+ * and, if set, calls @done once the block is finished. @done may be invoked
+ * from the crypto driver's completion context, so it must not sleep.
+ */
+struct aead_msg {
+	char *data;
+	char *out;
+	int len;
+	char *key;
+	char *iv;
+	char *mac;
+	uint64_t seq;
+	void (*done)(struct aead_msg *msg, int err);
+	void *private;
+	int err;
+};
 
 struct aead_cipher {
 	int (*encrypt)(struct aead_cipher *ac, char *data, int len, char *key,
 		       char *iv, char *mac, uint64_t seq, char *out);
 	int (*decrypt)(struct aead_cipher *ac, char *data, int len, char *key,
 		       char *iv, char *mac, uint64_t seq, char *out);
+	int (*encrypt_many)(struct aead_cipher *ac, struct aead_msg *msgs,
+			    int nr);
+	int (*decrypt_many)(struct aead_cipher *ac, struct aead_msg *msgs,
+			    int nr);
 	void (*destroy)(struct aead_cipher *ac);
 };
 
@@ -54,14 +77,43 @@ struct aead_cipher {
  *  | sector_LE |  IV |  sector in/out    |  tag in/out  |
  */
 
+struct aes_gcm_batch {
+	atomic_t pending;
+	struct completion done;
+	int err;
+};
+
+struct aes_gcm_request {
+	struct aead_request *req;
+	struct scatterlist sg_in[AEAD_MSG_NR_PART];
+	struct scatterlist sg_out[AEAD_MSG_NR_PART];
+	uint64_t seq;
+	struct aead_msg *msg;
+	struct aes_gcm_batch *batch;
+};
+
+/*
+ * A tfm together with a set of preallocated requests. The last key set on
+ * the tfm is remembered, so a run of blocks sharing one key (e.g. a whole
+ * data segment) only pays for crypto_aead_setkey once.
+ */
+struct aes_gcm_slot {
+	struct crypto_aead *tfm;
+	struct mutex lock;
+	bool key_valid;
+	char key[AES_GCM_KEY_SIZE];
+	char zero_iv[AES_GCM_IV_SIZE];
+	struct aes_gcm_request reqs[AEAD_ENGINE_QUEUE_DEPTH];
+};
+
 struct aes_gcm_cipher {
 	struct aead_cipher aead_cipher;
-	struct crypto_aead *tfm;
+	struct aes_gcm_slot **slots;
+	int nr_slots;
 	size_t key_size;
 	size_t block_size;
 	size_t auth_size;
 	size_t iv_size;
-	struct mutex lock;
 };
 
 /*
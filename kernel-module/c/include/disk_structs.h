@@ -8,6 +8,7 @@
 #define DM_JINDISK_DISK_STRUCTS_H
 
 #include <linux/types.h>
+#include <linux/xarray.h>
 #include "crypto.h"
 
 typedef uint64_t dm_block_t;
@@ -21,10 +22,23 @@ struct disk_array {
 	struct dm_bufio_client *bc;
 	struct skcipher *skcipher;
 	char key[AES_CBC_KEY_SIZE];
+	// blocks changed since the last checkpoint, all of them after loading
+	size_t nr_block;
+	unsigned long *dirty;
+	// blocks of the running checkpoint not copied yet, and the contents
+	// saved by writers that changed them first, under the xarray lock
+	unsigned long *frozen;
+	struct xarray cow;
 
 	int (*format)(struct disk_array *this, bool value);
 	int (*set)(struct disk_array *this, size_t index, void *entry);
+	int (*set_range)(struct disk_array *this, size_t index, size_t count,
+			 void *entries);
 	int (*get)(struct disk_array *this, size_t index, void *entry);
+	// move the dirty bitmap to snapshot and freeze those blocks
+	void (*freeze)(struct disk_array *this, unsigned long *snapshot);
+	// copy a frozen block as it was at the freeze, and thaw it
+	int (*read_frozen)(struct disk_array *this, size_t blk, void *out);
 };
 
 struct disk_array *disk_array_create(struct dm_bufio_client *bc, char *key,
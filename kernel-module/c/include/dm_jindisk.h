@@ -11,11 +11,15 @@
 #include <linux/bitmap.h>
 #include <linux/device-mapper.h>
 #include <linux/dm-io.h>
+#include <linux/mempool.h>
 #include <linux/rwsem.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
+#include "cache.h"
+#include "io_engine.h"
 #include "lsm_tree.h"
+#include "readahead.h"
 
 extern struct dm_jindisk *jindisk;
 extern struct disk_statistics disk_counter;
@@ -24,9 +28,20 @@ extern size_t NR_SEGMENT;
 #define DM_MSG_PREFIX "jindisk"
 
 #define INF_ADDR (~0ULL)
-#define MAX_READER 4
+#define NR_READER_PER_CPU 16
+// weighted round-robin between queued reads and writes
+#define READ_DISPATCH_WEIGHT 8
+#define WRITE_DISPATCH_WEIGHT 1
 #define MIN_NR_FETCH (size_t)1
 #define MAX_NR_FETCH (size_t)64
+// objects reserved in each mempool of the io path
+#define JINDISK_MIN_IOS 64
+// reads in flight with their lookup state taken from the reserve
+#define JINDISK_MIN_READS 16
+// seconds between checkpoints, taken early once this many metadata blocks
+// changed or the journal is half full
+#define CHECKPOINT_INTERVAL 30
+#define CHECKPOINT_DIRTY_BLOCKS 4096
 
 #define SECTORS_PER_BLOCK 8
 #define BLOCKS_PER_SEGMENT 1024
@@ -38,7 +53,9 @@ extern size_t NR_SEGMENT;
 struct blk_info {
 	dm_block_t lba;
 	struct record *record;
-	void *page_addr;
+	struct page *page;
+	uint64_t gen;
+	struct page_list pl;
 };
 
 struct diskio_ctx {
@@ -47,9 +64,40 @@ struct diskio_ctx {
 	int blk_count;
 	void *io_buffer;
 	enum dm_io_mem_type mem_type;
+	struct page_list *pages;
 	struct completion *wait;
 	atomic_t *cnt;
-	struct blk_info **infos;
+	blk_status_t *status; // of the bio, set if any block failed
+	struct blk_info *infos;
+	struct aead_msg *msgs;
+	struct work_struct work;
+};
+
+/* per-bio private data, sized through ti->per_io_data_size */
+struct jindisk_io {
+	struct bio *bio;
+	u64 queued_ns;
+	struct work_struct work;
+};
+
+/*
+ * Lookup and decryption state of a read, taken from read_pool while it
+ * runs. records[] and found are indexed by lba - start.
+ */
+struct jindisk_read {
+	struct record records[MAX_NR_FETCH];
+	DECLARE_BITMAP(found, MAX_NR_FETCH);
+	struct blk_info blks[MAX_NR_FETCH];
+	struct aead_msg msgs[MAX_NR_FETCH];
+};
+
+/* per-cpu submission queue, drained on the cpu the bios were mapped on */
+struct jindisk_queue {
+	spinlock_t lock;
+	struct bio_list reads;
+	struct bio_list writes;
+	unsigned int nr_reads;
+	unsigned int nr_writes;
 	struct work_struct work;
 };
 
@@ -57,28 +105,55 @@ struct disk_statistics {
 	uint64_t read_req_blocks;
 	uint64_t read_io_blocks;
 	uint64_t read_io_count;
+	uint64_t read_queued_bios;
+	uint64_t read_queue_wait_ns;
 
 	uint64_t write_req_blocks;
 	uint64_t write_io_blocks;
 	uint64_t write_io_count;
+	uint64_t write_queued_bios;
+	uint64_t write_queue_wait_ns;
+	uint64_t write_stalls; // writers waiting for a clean segment buffer
+	uint64_t write_stall_ns;
+	uint64_t direct_write_blocks; // encrypted from the bio pages
+	uint64_t partial_log_blocks; // logged by flushes of partial segments
+	uint64_t discard_blocks;
+	uint64_t stale_blocks; // overwritten blocks invalidated in background
+	uint64_t commits;
+	uint64_t commit_bios; // flushes and fua writes completed by commits
+	uint64_t checkpoints;
+	uint64_t checkpoint_blocks; // metadata blocks copied by checkpoints
 
 	uint64_t minor_compaction;
 	uint64_t major_compaction;
+	uint64_t memtable_slowdowns; // puts delayed by queued immutable memtables
+	uint64_t memtable_stops; // rotations waiting for a minor compaction
+	uint64_t memtable_stop_ns;
 	uint64_t bit_created;
 	uint64_t bit_removed;
 	uint64_t bit_node_cache_hit;
 	uint64_t bit_node_cache_miss;
+	uint64_t data_cache_hit;
+	uint64_t data_cache_miss;
+	uint64_t readahead_blocks;
 };
 
 /* For underlying device */
 struct dm_jindisk {
 	sector_t start;
-	spinlock_t req_lock;
 	struct dm_dev *raw_dev;
-	// workers
-	struct work_struct deferred_bio_worker;
-	// bio lists
-	struct bio_list deferred_bios;
+	// per-cpu bio queues and their workers
+	struct jindisk_queue __percpu *queues;
+	struct workqueue_struct *queue_wq;
+	struct workqueue_struct *read_wq;
+	// flushes and fua writes waiting for the next group commit
+	struct workqueue_struct *commit_wq;
+	struct work_struct commit_work;
+	spinlock_t commit_lock;
+	struct bio_list commit_bios;
+	// background checkpoints of the metadata
+	struct workqueue_struct *checkpoint_wq;
+	struct delayed_work checkpoint_work;
 	// jindisk components
 	struct metadata *meta;
 	struct segment_buffer *seg_buffer;
@@ -86,15 +161,27 @@ struct dm_jindisk {
 	struct lsm_tree *lsm_tree;
 	// aead cipher
 	struct aead_cipher *cipher;
-	// io client
-	struct dm_io_client *io_client;
-	// max reader limit
-	struct semaphore max_reader;
+	// decrypted data blocks, NULL if disabled
+	struct block_cache *data_cache;
+	struct readahead *readahead;
+	// bio based io engine
+	struct io_engine *io_engine;
+	// reserves for the objects allocated per io
+	struct kmem_cache *diskio_ctx_cache;
+	mempool_t *diskio_ctx_pool;
+	mempool_t *page_pool;
+	mempool_t *read_pool;
 };
 
 void jindisk_read_blocks(dm_block_t pba, size_t count, void *buffer,
 			 enum dm_io_mem_type mem_type, void *ctx);
 void jindisk_write_blocks(dm_block_t pba, size_t count, void *buffer,
 			  enum dm_io_mem_type mem_type);
+void jindisk_write_blocks_async(dm_block_t pba, size_t count, void *buffer,
+				enum dm_io_mem_type mem_type,
+				io_engine_notify_fn fn, void *context);
+void jindisk_journal_blocks(dm_block_t pba, size_t count);
+int jindisk_flush_device(void);
+int flush_and_commit(struct dm_jindisk *jindisk);
 
 #endif
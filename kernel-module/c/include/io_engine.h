@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2022 Ant Group CO., Ltd. All rights reserved.
+ *
+ * This file is released under the GPLv2.
+ */
+
+#ifndef DM_JINDISK_IO_ENGINE_H
+#define DM_JINDISK_IO_ENGINE_H
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/dm-io.h>
+#include <linux/mempool.h>
+#include <linux/wait.h>
+
+#define IO_ENGINE_MIN_JOBS 64
+// bios of all requests allowed in flight at the same time
+#define IO_ENGINE_MAX_INFLIGHT 256
+
+typedef void (*io_engine_notify_fn)(int error, void *context);
+
+/*
+ * A request covers count sectors from sector on bdev. Its memory is
+ * described the same way as for dm-io: a kmalloc'd or vmalloc'd buffer, or
+ * a page_list. Without a notify function the request is synchronous and
+ * submit returns its error; otherwise notify is called once every bio of
+ * the request has completed.
+ */
+struct io_request {
+	int bi_op; // REQ_OP_* with its REQ_* flags
+	struct block_device *bdev;
+	sector_t sector;
+	sector_t count;
+	enum dm_io_mem_type mem_type;
+	union {
+		void *addr;
+		struct page_list *pl;
+	} mem;
+	io_engine_notify_fn notify;
+	void *context;
+};
+
+struct io_engine {
+	int (*submit)(struct io_engine *ie, struct io_request *req);
+	void (*destroy)(struct io_engine *ie);
+};
+
+/*
+ * Requests are split into page-vector bios from a preallocated bio_set and
+ * submitted under a plug. The bios of a request share one io_job, whose
+ * last completion notifies the submitter.
+ */
+struct bio_io_engine {
+	struct io_engine io_engine;
+
+	struct bio_set bs;
+	mempool_t *job_pool;
+	atomic_t inflight;
+	wait_queue_head_t wait;
+};
+
+struct io_engine *bio_io_engine_create(void);
+
+#endif
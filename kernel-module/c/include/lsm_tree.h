@@ -9,6 +9,11 @@
 
 #include <linux/fs.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "cache.h"
 #include "crypto.h"
@@ -18,6 +23,10 @@
 #define DEFAULT_LSM_TREE_NR_DISK_LEVEL 2
 #define DEFAULT_LSM_LEVEL0_NR_FILE 1
 #define DEFAULT_LSM_FILE_CAPACITY (131072) // 512M/4K records
+// immutable memtables waiting for minor compaction
+#define MAX_IMMUTABLE_MEMTABLES 4
+#define SLOWDOWN_IMMUTABLE_MEMTABLES 2
+#define IMMUTABLE_SLOWDOWN_US 100 // per put and memtable over the slowdown
 
 // record, lba => (pba, key, iv, mac)
 struct record {
@@ -76,9 +85,15 @@ void bit_node_print(struct bit_node *bit_node);
 size_t __bit_array_len(size_t capacity, size_t nr_degree);
 size_t calculate_bit_size(size_t nr_record, size_t nr_degree);
 
+struct lsm_catalogue;
+
 struct lsm_file {
 	size_t id, level, version;
 	struct list_head node;
+	// held by its level and by each lsm version listing the file
+	refcount_t refs;
+	// set once compacted away, released there with the last reference
+	struct lsm_catalogue *catalogue;
 
 	struct iterator *(*iterator)(struct lsm_file *lsm_file);
 	uint32_t (*get_first_key)(struct lsm_file *lsm_file);
@@ -102,6 +117,9 @@ struct bit_file {
 	struct cached_inner *cached_root;
 };
 
+void lsm_file_get(struct lsm_file *file);
+void lsm_file_put(struct lsm_file *file);
+
 struct lsm_file *bit_file_create(struct file *file, loff_t root, size_t id,
 				 size_t level, size_t version,
 				 uint32_t first_key, uint32_t last_key,
@@ -200,20 +218,50 @@ struct compaction_job *compaction_job_create(struct file *file,
 					     struct lsm_level *level1,
 					     struct lsm_level *level2);
 
+struct lsm_version_level {
+	size_t level, size;
+	struct bit_file **files;
+};
+
+/*
+ * What a lookup searches after the memtable: the immutable memtables, newest
+ * first, and the files of each disk level. A version never changes once published under
+ * rcu, readers hold a reference to it instead of taking the level locks, and
+ * compactions publish a new one each time they are done with the levels.
+ */
+struct lsm_version {
+	refcount_t refs;
+	size_t nr_immutable;
+	struct memtable *immutables[MAX_IMMUTABLE_MEMTABLES];
+	struct rcu_work rwork;
+	size_t nr_level;
+	struct lsm_version_level levels[];
+};
+
 struct lsm_tree {
 	struct file *file;
 	struct lsm_catalogue *catalogue;
 	struct memtable *memtable;
 	struct rw_semaphore m_lock;
-	struct memtable *immutable_memtable;
-	struct rw_semaphore im_lock;
+	// waiting for minor compaction in order, oldest first
+	struct memtable *immutables[MAX_IMMUTABLE_MEMTABLES];
+	size_t nr_immutable;
+	struct mutex im_lock;
+	// writers stopped on a full queue
+	wait_queue_head_t im_wait;
 	struct lsm_level **levels;
+	struct lsm_version __rcu *version;
+	// serializes building and publishing versions
+	struct mutex version_lock;
 	struct aead_cipher *cipher;
 
 	void (*put)(struct lsm_tree *this, uint32_t key, void *val);
+	void (*put_batch)(struct lsm_tree *this, uint32_t *keys,
+			  struct record **records, size_t n);
 	int (*search)(struct lsm_tree *this, uint32_t key, void *val);
-	struct memtable *(*range_search)(struct lsm_tree *this, uint32_t start,
-					 uint32_t end);
+	int (*range_search)(struct lsm_tree *this, uint32_t start,
+			    uint32_t count, struct record *records,
+			    unsigned long *found);
 	void (*destroy)(struct lsm_tree *this);
 };
 
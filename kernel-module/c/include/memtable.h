@@ -7,14 +7,22 @@
 #ifndef DM_JINDISK_MEMTABLE_H
 #define DM_JINDISK_MEMTABLE_H
 
+#include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/refcount.h>
 #include <linux/rwsem.h>
 
 #define DEFAULT_MEMTABLE_CAPACITY DEFAULT_LSM_FILE_CAPACITY
+// lookups in the mutable memtable take no lock with the skiplist memtable
+#define ENABLE_SKIPLIST_MEMTABLE 1
+#define SKIPLIST_ARENA_SIZE (8 << 20)
+#define SKIPLIST_MAX_HEIGHT 16
 
 typedef uint32_t memtable_key_t;
 typedef void (*dtr_fn_t)(void *);
 
+struct iterator;
+
 struct memtable_entry {
 	memtable_key_t key;
 	void *val;
@@ -26,12 +34,17 @@ struct memtable_entry {
 
 struct memtable {
 	size_t size;
+	// once immutable, held by the lsm tree and the versions listing it
+	refcount_t refs;
 
 	void *(*put)(struct memtable *memtable, memtable_key_t key, void *val,
 		     dtr_fn_t dtr_fn);
 	int (*get)(struct memtable *memtable, memtable_key_t key, void **p_val);
 	int (*get_all_entry)(struct memtable *memtable,
 			     struct list_head *entries);
+	// entries in key order, for the minor compaction
+	struct iterator *(*iterator)(struct memtable *memtable);
+	bool (*full)(struct memtable *memtable);
 	void *(*remove)(struct memtable *memtable, memtable_key_t key);
 	bool (*contains)(struct memtable *memtable, memtable_key_t key);
 	void (*clear)(struct memtable *memtable);
@@ -46,4 +59,31 @@ struct rbtree_memtable {
 
 struct memtable *rbtree_memtable_create(void);
 
+// skiplist memtable definition
+struct skiplist_node {
+	memtable_key_t key;
+	int height;
+	// owned by the memtable, or its negative record
+	void *val;
+	struct skiplist_node *next[];
+};
+
+/*
+ * Puts are serialized by a mutex and publish nodes with release stores, so
+ * that gets run without any lock. Nodes come from an arena of a fixed size
+ * and are never freed before the memtable is, replaced records are freed
+ * after an rcu grace period.
+ */
+struct skiplist_memtable {
+	struct memtable memtable;
+	struct mutex lock;
+	char *arena;
+	size_t arena_size, arena_used;
+	int height;
+	struct skiplist_node *head;
+	void *negative;
+};
+
+struct memtable *skiplist_memtable_create(size_t arena_size);
+
 #endif
@@ -120,6 +120,8 @@ struct reverse_index_table {
 	int (*format)(struct reverse_index_table *this);
 	int (*set)(struct reverse_index_table *this, dm_block_t pba,
 		   dm_block_t lba);
+	int (*set_range)(struct reverse_index_table *this, dm_block_t pba,
+			 size_t count, dm_block_t *lbas);
 	int (*get)(struct reverse_index_table *this, dm_block_t pba,
 		   dm_block_t *lba);
 	int (*reset)(struct reverse_index_table *this, dm_block_t pba,
@@ -161,6 +163,7 @@ struct dst {
 	int (*return_segment)(struct dst *this, size_t segno);
 	int (*take_block)(struct dst *this, dm_block_t blkaddr);
 	int (*return_block)(struct dst *this, dm_block_t block_id);
+	int (*return_blocks)(struct dst *this, dm_block_t *pbas, size_t count);
 	int (*find_logging_block)(struct dst *this, dm_block_t *pba);
 	bool (*victim_empty)(struct dst *this);
 	struct victim *(*peek_victim)(struct dst *this);
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2022 Ant Group CO., Ltd. All rights reserved.
+ *
+ * This file is released under the GPLv2.
+ */
+
+#ifndef DM_JINDISK_READAHEAD_H
+#define DM_JINDISK_READAHEAD_H
+
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "disk_structs.h"
+
+#define RA_NR_STREAMS 8
+#define RA_MIN_WINDOW 32
+#define RA_MAX_WINDOW 1024
+#define RA_MAX_INFLIGHT 4
+
+/*
+ * A sequential stream is a run of reads where each one starts at the block
+ * right after the previous one. Blocks [ra_start, ra_end) of the stream have
+ * been prefetched into the data cache.
+ */
+struct ra_stream {
+	dm_block_t next;
+	dm_block_t ra_start;
+	dm_block_t ra_end;
+	size_t window;
+	int nr_seq;
+	unsigned long last_used;
+};
+
+struct readahead {
+	/*
+	 * Report a finished read of [start, start + count), @hits of which
+	 * were served from the data cache.
+	 */
+	void (*observe)(struct readahead *ra, dm_block_t start, size_t count,
+			size_t hits);
+	void (*destroy)(struct readahead *ra);
+};
+
+struct stream_readahead {
+	struct readahead readahead;
+
+	spinlock_t lock;
+	struct ra_stream streams[RA_NR_STREAMS];
+	atomic_t inflight;
+};
+
+struct readahead *readahead_create(void);
+
+#endif
@@ -11,10 +11,23 @@
 #define FOREGROUND_GC_THRESHOLD (NR_SEGMENT - NR_GC_PRESERVED)
 #define BACKGROUND_GC_THRESHOLD (NR_SEGMENT - NR_GC_PRESERVED)
 #define LEAST_CLEAN_SEGMENT_ONCE 5
+// overwritten blocks waiting to be invalidated in the background
+#define STALE_LOG_SIZE 8192
+#define STALE_LOG_BATCH 512
+
+struct stale_block {
+	dm_block_t pba;
+	dm_block_t lba;
+};
 
 struct segment_allocator {
 	int (*alloc)(struct segment_allocator *al, size_t *seg);
 	void (*foreground_gc)(struct segment_allocator *al);
+	// pba no longer holds lba, drop it from the rit and dst later on
+	void (*invalidate)(struct segment_allocator *al, dm_block_t pba,
+			   dm_block_t lba);
+	// invalidate every block logged so far
+	void (*drain)(struct segment_allocator *al);
 	void (*destroy)(struct segment_allocator *al);
 	size_t (*nr_valid_segment_get)(struct segment_allocator *al);
 	void (*nr_valid_segment_set)(struct segment_allocator *al, size_t val);
@@ -26,6 +39,13 @@ struct default_segment_allocator {
 	size_t nr_valid_segment;
 	void *buffer;
 	struct rw_semaphore gc_lock;
+	// logged by writers under stale_lock, swapped with the spare on drain
+	spinlock_t stale_lock;
+	struct stale_block *stale, *spare;
+	size_t nr_stale;
+	dm_block_t *returned;
+	struct mutex drain_lock;
+	struct work_struct drain_work;
 };
 
 struct segment_allocator *sa_create(void);
@@ -10,25 +10,64 @@
 #include <linux/bio.h>
 #include <linux/completion.h>
 #include <linux/dm-io.h>
+#include <linux/mempool.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
 
 #include "crypto.h"
 #include "memtable.h"
 
 #define SEGMENT_BUFFER_SIZE (SECTORS_PER_SEGMENT * SECTOR_SIZE)
+// default number of segment buffers, one filling and the rest flushing
 #define POOL_SIZE 4
+#define MIN_POOL_SIZE 2
+#define MAX_POOL_SIZE 64
+// blocks encrypted and written as one step of the flush pipeline
+#define FLUSH_CHUNK_BLOCKS AEAD_ENGINE_QUEUE_DEPTH
+#define FLUSH_MAX_CHUNKS (BLOCKS_PER_SEGMENT / FLUSH_CHUNK_BLOCKS)
+// blocks a cpu stages before merging them into the current segment
+#define SEGBUF_STAGE_BLOCKS 16
+// bios of at least this many blocks are encrypted straight from their pages
+#define SEGBUF_DIRECT_MIN_BLOCKS 32
 
 struct segment_block {
 	dm_block_t lba;
+	u64 seq; // 0 for blocks rewritten by gc, older than any bio write
+	bool logged; // already in the log by a partial flush
 	void *plain_block;
 	struct rb_node node;
+	union {
+		struct list_head list; // while staged or detached
+		struct rcu_head rcu; // once freed from the index
+	};
+};
+
+// bio writes staged on one cpu, at most one block per lba
+struct segbuf_stage {
+	spinlock_t lock;
+	int nr;
+	u64 filter; // hashed lbas of the staged blocks
+	struct list_head blocks;
+};
+
+enum data_segment_state {
+	SEGMENT_CLEAN, // published, may be recycled
+	SEGMENT_FILLING, // the current buffer
+	SEGMENT_DIRTY, // full and queued for flushing
+	SEGMENT_FLUSHING,
 };
 
 struct data_segment {
+	enum data_segment_state state;
 	int size;
-	size_t cur_segment;
 	char seg_key[AES_GCM_KEY_SIZE];
-	void *cipher_segment;
 	struct rb_root root;
 };
 
@@ -36,9 +75,13 @@ struct segment_buffer {
 	int (*push_bio)(struct segment_buffer *buf, struct bio *bio);
 	void (*push_block)(struct segment_buffer *buf, dm_block_t lba,
 			   void *buffer, bool rflag);
+	int (*discard_bio)(struct segment_buffer *buf, struct bio *bio);
 	int (*query_block)(struct segment_buffer *buf, uint32_t lba,
 			   void *buffer);
 	void (*flush_bios)(struct segment_buffer *buf, int index);
+	// keep writes off a gc victim, false if it is the direct segment
+	bool (*gc_begin)(struct segment_buffer *buf, size_t segno);
+	void (*gc_end)(struct segment_buffer *buf);
 	void (*destroy)(struct segment_buffer *buf);
 	void *(*implementer)(struct segment_buffer *buf);
 };
@@ -47,11 +90,67 @@ struct default_segment_buffer {
 	struct segment_buffer segment_buffer;
 
 	int cur_buffer;
-	struct data_segment buffer[POOL_SIZE];
-	struct rw_semaphore rw_lock[POOL_SIZE];
+	int nr_buffers;
+	struct data_segment *buffer;
 	struct rw_semaphore lock;
+	/*
+	 * Rotation only recycles a clean buffer. When every other buffer is
+	 * still dirty writers wait here for a flush to finish.
+	 */
+	wait_queue_head_t clean_wait;
+
+	/*
+	 * Bio writes are copied into a stage of the local cpu and merged into
+	 * the current segment in batches under lock. Every staged block takes
+	 * a sequence number, so that a merge never lets an older write of an
+	 * lba replace a newer one.
+	 */
+	struct segbuf_stage __percpu *stages;
+	atomic64_t seq;
+
+	/*
+	 * The newest buffered block of every lba, looked up under RCU. Blocks
+	 * leaving the index are freed after a grace period. Merges move
+	 * blocks from the stages into the index inside merge_seq, readers
+	 * that raced with one retry under lock.
+	 */
+	struct xarray index;
+	seqcount_rwsem_t merge_seq;
+
+	/*
+	 * Flushes encrypt and write concurrently, each into a ciphertext
+	 * buffer of cipher_pool, but publish their records to the index in
+	 * the order of their tickets, which is the order they were started.
+	 */
+	atomic64_t next_ticket;
+	u64 published;
+	wait_queue_head_t publish_wait;
+	// first failed segment write, commits fail with it from then on
+	int write_error;
+	struct mutex alloc_lock;
+	mempool_t *flush_pool;
+	mempool_t *cipher_pool;
+
+	/*
+	 * Large bios bypass the buffers: they reserve a run of pbas in the
+	 * direct segment under alloc_lock, and are encrypted and written as
+	 * one chunk that is published with its own ticket.
+	 */
+	dm_block_t direct_next;
+	dm_block_t direct_end;
+	// held for read by direct writes and discards until published, for
+	// write by gc
+	struct rw_semaphore direct_lock;
+	/*
+	 * A flush of the current buffer only appends the blocks not logged
+	 * yet to the direct segment, they are written again with the whole
+	 * segment once it is full.
+	 */
+	struct mutex log_lock;
+	mempool_t *direct_pool;
+	mempool_t *direct_cipher_pool;
 };
 
-struct segment_buffer *segbuf_create(void);
+struct segment_buffer *segbuf_create(int nr_buffers);
 
 #endif
@@ -4,6 +4,8 @@
  * This file is released under the GPLv2.
  */
 
+#include <linux/atomic.h>
+#include <linux/kernel.h>
 #include <linux/radix-tree.h>
 #include <linux/slab.h>
 #include <linux/types.h>
@@ -141,3 +143,254 @@ struct cache *lru_cache_create(size_t capacity)
 	lru_cache_init(this, capacity);
 	return &this->cache;
 }
+
+static inline atomic64_t *twoq_cache_gen(struct twoq_cache *this, uint64_t key)
+{
+	return &this->gens[key % BLOCK_CACHE_GEN_SLOTS];
+}
+
+static void twoq_cache_node_destroy(struct twoq_cache_node *node)
+{
+	if (!node)
+		return;
+
+	kfree(node->data);
+	kfree(node);
+}
+
+static void twoq_cache_unlink(struct twoq_cache *this,
+			      struct twoq_cache_node *node)
+{
+	list_del(&node->list);
+	switch (node->queue) {
+	case TWOQ_A1IN:
+		this->nr_in -= 1;
+		break;
+	case TWOQ_A1OUT:
+		this->nr_out -= 1;
+		break;
+	case TWOQ_AM:
+		this->nr_am -= 1;
+		break;
+	}
+}
+
+static void twoq_cache_link(struct twoq_cache *this,
+			    struct twoq_cache_node *node, enum twoq_queue queue)
+{
+	node->queue = queue;
+	switch (queue) {
+	case TWOQ_A1IN:
+		list_add(&node->list, &this->a1in);
+		this->nr_in += 1;
+		break;
+	case TWOQ_A1OUT:
+		list_add(&node->list, &this->a1out);
+		this->nr_out += 1;
+		break;
+	case TWOQ_AM:
+		list_add(&node->list, &this->am);
+		this->nr_am += 1;
+		break;
+	}
+}
+
+static void twoq_cache_remove(struct twoq_cache *this,
+			      struct twoq_cache_node *node)
+{
+	twoq_cache_unlink(this, node);
+	radix_tree_delete(&this->root, node->key);
+	twoq_cache_node_destroy(node);
+}
+
+/*
+ * Make room for one more resident block and hand back the buffer of the
+ * victim, if any, so that it can be reused for the incoming block.
+ */
+static void *twoq_cache_reclaim(struct twoq_cache *this)
+{
+	struct twoq_cache_node *node;
+	void *data;
+
+	if (this->nr_in + this->nr_am < this->capacity)
+		return NULL;
+
+	if (this->nr_in > this->kin || list_empty(&this->am)) {
+		node = list_last_entry(&this->a1in, struct twoq_cache_node,
+				       list);
+		twoq_cache_unlink(this, node);
+		data = node->data;
+		node->data = NULL;
+		twoq_cache_link(this, node, TWOQ_A1OUT);
+		if (this->nr_out > this->kout) {
+			node = list_last_entry(&this->a1out,
+					       struct twoq_cache_node, list);
+			twoq_cache_remove(this, node);
+		}
+	} else {
+		node = list_last_entry(&this->am, struct twoq_cache_node, list);
+		twoq_cache_unlink(this, node);
+		radix_tree_delete(&this->root, node->key);
+		data = node->data;
+		kfree(node);
+	}
+	return data;
+}
+
+int twoq_cache_get(struct block_cache *bc, uint64_t key, void *data_out)
+{
+	struct twoq_cache *this =
+		container_of(bc, struct twoq_cache, block_cache);
+	struct twoq_cache_node *node;
+
+	mutex_lock(&this->lock);
+	node = radix_tree_lookup(&this->root, key);
+	if (!node || !node->data) {
+		mutex_unlock(&this->lock);
+		return -ENODATA;
+	}
+
+	if (node->queue == TWOQ_AM) {
+		list_del(&node->list);
+		list_add(&node->list, &this->am);
+	}
+	memcpy(data_out, node->data, this->block_size);
+	mutex_unlock(&this->lock);
+	return 0;
+}
+
+void twoq_cache_put(struct block_cache *bc, uint64_t key, void *data,
+		    uint64_t gen)
+{
+	struct twoq_cache *this =
+		container_of(bc, struct twoq_cache, block_cache);
+	struct twoq_cache_node *node;
+	void *buffer = NULL;
+
+	mutex_lock(&this->lock);
+	if (atomic64_read(twoq_cache_gen(this, key)) != gen)
+		goto out;
+
+	node = radix_tree_lookup(&this->root, key);
+	if (node && node->data) {
+		memcpy(node->data, data, this->block_size);
+		if (node->queue == TWOQ_AM) {
+			list_del(&node->list);
+			list_add(&node->list, &this->am);
+		}
+		goto out;
+	}
+	/* keep a ghost entry out of reach of the reclaim below */
+	if (node)
+		twoq_cache_unlink(this, node);
+
+	buffer = twoq_cache_reclaim(this);
+	if (!buffer)
+		buffer = kmalloc(this->block_size, GFP_NOIO);
+	if (!buffer) {
+		if (node)
+			twoq_cache_link(this, node, TWOQ_A1OUT);
+		goto out;
+	}
+	memcpy(buffer, data, this->block_size);
+
+	if (node) {
+		/* referenced again while remembered on A1out: it is hot */
+		node->data = buffer;
+		twoq_cache_link(this, node, TWOQ_AM);
+		goto out;
+	}
+
+	node = kzalloc(sizeof(struct twoq_cache_node), GFP_NOIO);
+	if (!node) {
+		kfree(buffer);
+		goto out;
+	}
+	node->key = key;
+	node->data = buffer;
+	if (radix_tree_insert(&this->root, key, node)) {
+		twoq_cache_node_destroy(node);
+		goto out;
+	}
+	twoq_cache_link(this, node, TWOQ_A1IN);
+out:
+	mutex_unlock(&this->lock);
+}
+
+uint64_t twoq_cache_generation(struct block_cache *bc, uint64_t key)
+{
+	struct twoq_cache *this =
+		container_of(bc, struct twoq_cache, block_cache);
+
+	return atomic64_read(twoq_cache_gen(this, key));
+}
+
+void twoq_cache_invalidate(struct block_cache *bc, uint64_t key)
+{
+	struct twoq_cache *this =
+		container_of(bc, struct twoq_cache, block_cache);
+	struct twoq_cache_node *node;
+
+	atomic64_inc(twoq_cache_gen(this, key));
+	mutex_lock(&this->lock);
+	node = radix_tree_lookup(&this->root, key);
+	if (node)
+		twoq_cache_remove(this, node);
+	mutex_unlock(&this->lock);
+}
+
+void twoq_cache_destroy(struct block_cache *bc)
+{
+	struct twoq_cache *this =
+		container_of(bc, struct twoq_cache, block_cache);
+	struct twoq_cache_node *node, *temp;
+
+	list_for_each_entry_safe (node, temp, &this->a1in, list)
+		twoq_cache_node_destroy(node);
+	list_for_each_entry_safe (node, temp, &this->a1out, list)
+		twoq_cache_node_destroy(node);
+	list_for_each_entry_safe (node, temp, &this->am, list)
+		twoq_cache_node_destroy(node);
+
+	kfree(this);
+}
+
+void twoq_cache_init(struct twoq_cache *this, size_t capacity,
+		     size_t block_size)
+{
+	int i;
+
+	this->block_size = block_size;
+	this->capacity = capacity;
+	this->kin = max_t(size_t, capacity / 4, 1);
+	this->kout = max_t(size_t, capacity / 2, 1);
+	this->nr_in = this->nr_out = this->nr_am = 0;
+	mutex_init(&this->lock);
+	INIT_RADIX_TREE(&this->root, GFP_NOIO);
+	INIT_LIST_HEAD(&this->a1in);
+	INIT_LIST_HEAD(&this->a1out);
+	INIT_LIST_HEAD(&this->am);
+	for (i = 0; i < BLOCK_CACHE_GEN_SLOTS; i++)
+		atomic64_set(&this->gens[i], 0);
+
+	this->block_cache.get = twoq_cache_get;
+	this->block_cache.put = twoq_cache_put;
+	this->block_cache.generation = twoq_cache_generation;
+	this->block_cache.invalidate = twoq_cache_invalidate;
+	this->block_cache.destroy = twoq_cache_destroy;
+}
+
+struct block_cache *twoq_cache_create(size_t capacity, size_t block_size)
+{
+	struct twoq_cache *this;
+
+	if (!capacity)
+		return NULL;
+
+	this = kzalloc(sizeof(struct twoq_cache), GFP_KERNEL);
+	if (!this)
+		return NULL;
+
+	twoq_cache_init(this, capacity, block_size);
+	return &this->block_cache;
+}
@@ -4,8 +4,11 @@
  * This file is released under the GPLv2.
  */
 
+#include <linux/cpumask.h>
+#include <linux/mm.h>
 #include <linux/random.h>
 #include <linux/rwsem.h>
+#include <linux/vmalloc.h>
 
 #include "../include/crypto.h"
 #include "../include/dm_jindisk.h"
@@ -18,79 +21,225 @@ void btox(char *xp, const char *bb, int n)
 		xp[n] = xx[(bb[n >> 1] >> ((1 - (n & 1)) << 2)) & 0xF];
 }
 
-int aes_gcm_cipher_encrypt(struct aead_cipher *ac, char *data, int len,
-			   char *key, char *iv, char *mac, uint64_t seq,
-			   char *out)
+static void aead_sg_set_buf(struct scatterlist *sg, void *buf, int len)
 {
-	int r;
-	char *riv;
-	struct aead_request *req;
-	char zero_iv[AES_GCM_IV_SIZE] = { 0 };
-	struct scatterlist sg_in[AEAD_MSG_NR_PART], sg_out[AEAD_MSG_NR_PART];
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aes_gcm_cipher *this =
-		container_of(ac, struct aes_gcm_cipher, aead_cipher);
-#if defined(DEBUG)
+	/* data segments live in vmalloc space, one block never crosses a page */
+	if (is_vmalloc_addr(buf))
+		sg_set_page(sg, vmalloc_to_page(buf), len, offset_in_page(buf));
+	else
+		sg_set_buf(sg, buf, len);
+}
+
+static void aes_gcm_request_complete(struct aes_gcm_request *r, int err)
+{
+	struct aead_msg *msg = r->msg;
+	struct aes_gcm_batch *batch = r->batch;
 	char mac_hex[(AES_GCM_AUTH_SIZE << 1) + 1] = { 0 };
 	char key_hex[(AES_GCM_KEY_SIZE << 1) + 1] = { 0 };
-	char iv_hex[(AES_GCM_IV_SIZE << 1) + 1] = { 0 };
-#endif
-	if (iv)
-		riv = iv;
-	else
-		riv = zero_iv;
 
-	sg_init_table(sg_in, AEAD_MSG_NR_PART);
-	sg_set_buf(&sg_in[0], &seq, sizeof(uint64_t));
-	sg_set_buf(&sg_in[1], riv, this->iv_size);
-	sg_set_buf(&sg_in[2], data, len);
-	sg_set_buf(&sg_in[3], mac, this->auth_size);
+	if (err == -EBADMSG) {
+		btox(key_hex, msg->key, AES_GCM_KEY_SIZE << 1);
+		btox(mac_hex, msg->mac, AES_GCM_AUTH_SIZE << 1);
+		DMWARN("gcm(aes) authentication failed, key:%s, mac:%s, "
+		       "seq:%llu",
+		       key_hex, mac_hex, msg->seq);
+	} else if (err) {
+		DMERR("gcm(aes) request error:%d seq:%llu", err, msg->seq);
+	}
+
+	msg->err = err;
+	if (msg->done)
+		msg->done(msg, err);
+	if (err)
+		cmpxchg(&batch->err, 0, err);
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
 
-	sg_init_table(sg_out, AEAD_MSG_NR_PART);
-	sg_set_buf(&sg_out[0], &seq, sizeof(uint64_t));
-	sg_set_buf(&sg_out[1], riv, this->iv_size);
-	sg_set_buf(&sg_out[2], out, len);
-	sg_set_buf(&sg_out[3], mac, this->auth_size);
+static void aes_gcm_request_done(struct crypto_async_request *areq, int err)
+{
+	struct aes_gcm_request *r = areq->data;
 
-	r = mutex_lock_interruptible(&this->lock);
-	if (r)
-		goto exit;
+	/* a backlogged request has just been started */
+	if (err == -EINPROGRESS)
+		return;
 
-	crypto_aead_setauthsize(this->tfm, this->auth_size);
-	req = aead_request_alloc(this->tfm, GFP_KERNEL);
-	if (!req) {
-		DMERR("could not allocate aead request");
-		goto exit;
+	aes_gcm_request_complete(r, err);
+}
+
+static void aes_gcm_request_prepare(struct aes_gcm_cipher *this,
+				    struct aes_gcm_slot *slot,
+				    struct aes_gcm_request *r,
+				    struct aead_msg *msg, bool decrypt)
+{
+	char *riv = msg->iv ? msg->iv : slot->zero_iv;
+	int cryptlen = decrypt ? msg->len + this->auth_size : msg->len;
+
+	r->msg = msg;
+	r->seq = msg->seq;
+
+	sg_init_table(r->sg_in, AEAD_MSG_NR_PART);
+	sg_set_buf(&r->sg_in[0], &r->seq, sizeof(uint64_t));
+	sg_set_buf(&r->sg_in[1], riv, this->iv_size);
+	aead_sg_set_buf(&r->sg_in[2], msg->data, msg->len);
+	aead_sg_set_buf(&r->sg_in[3], msg->mac, this->auth_size);
+
+	sg_init_table(r->sg_out, AEAD_MSG_NR_PART);
+	sg_set_buf(&r->sg_out[0], &r->seq, sizeof(uint64_t));
+	sg_set_buf(&r->sg_out[1], riv, this->iv_size);
+	aead_sg_set_buf(&r->sg_out[2], msg->out, msg->len);
+	aead_sg_set_buf(&r->sg_out[3], msg->mac, this->auth_size);
+
+	aead_request_set_callback(r->req,
+				  CRYPTO_TFM_REQ_MAY_BACKLOG |
+					  CRYPTO_TFM_REQ_MAY_SLEEP,
+				  aes_gcm_request_done, r);
+	aead_request_set_crypt(r->req, r->sg_in, r->sg_out, cryptlen, riv);
+	aead_request_set_ad(r->req, sizeof(uint64_t) + this->iv_size);
+}
+
+/*
+ * Prefer the slot of the current CPU, steal an idle one if it is busy and
+ * only block when every slot is in use.
+ */
+static struct aes_gcm_slot *aes_gcm_slot_get(struct aes_gcm_cipher *this)
+{
+	int i, cpu = raw_smp_processor_id() % this->nr_slots;
+	struct aes_gcm_slot *slot;
+
+	for (i = 0; i < this->nr_slots; i++) {
+		slot = this->slots[(cpu + i) % this->nr_slots];
+		if (mutex_trylock(&slot->lock))
+			return slot;
 	}
+	slot = this->slots[cpu];
+	mutex_lock(&slot->lock);
+	return slot;
+}
 
-	aead_request_set_crypt(req, sg_in, sg_out, len, riv);
-	aead_request_set_ad(req, sizeof(uint64_t) + this->iv_size);
+static void aes_gcm_slot_put(struct aes_gcm_slot *slot)
+{
+	mutex_unlock(&slot->lock);
+}
 
-	r = crypto_aead_setkey(this->tfm, key, this->key_size);
+static int aes_gcm_slot_setkey(struct aes_gcm_cipher *this,
+			       struct aes_gcm_slot *slot, char *key)
+{
+	int r;
+
+	if (slot->key_valid && !memcmp(slot->key, key, this->key_size))
+		return 0;
+
+	r = crypto_aead_setkey(slot->tfm, key, this->key_size);
 	if (r) {
+		slot->key_valid = false;
 		DMERR("gcm(aes) key could not be set");
-		goto exit;
+		return r;
 	}
+	memcpy(slot->key, key, this->key_size);
+	slot->key_valid = true;
+	return 0;
+}
 
-	aead_request_set_callback(
-		req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
-		crypto_req_done, &wait);
-	r = crypto_wait_req(crypto_aead_encrypt(req), &wait);
-	if (r) {
-		DMERR("gcm(aes) encrypt error");
-		goto exit;
+/*
+ * Keep up to AEAD_ENGINE_QUEUE_DEPTH requests in flight on one slot. The
+ * window is drained whenever the key changes, since the key belongs to the
+ * tfm rather than to the request.
+ */
+static int aes_gcm_cipher_submit(struct aes_gcm_cipher *this,
+				 struct aead_msg *msgs, int nr, bool decrypt)
+{
+	int i = 0, n, r, err = 0;
+	struct aes_gcm_batch batch;
+	struct aes_gcm_slot *slot;
+	struct aes_gcm_request *req;
+
+	slot = aes_gcm_slot_get(this);
+	while (i < nr) {
+		atomic_set(&batch.pending, 1);
+		init_completion(&batch.done);
+		batch.err = 0;
+
+		for (n = 0; n < AEAD_ENGINE_QUEUE_DEPTH && i < nr; n++, i++) {
+			if (!slot->key_valid ||
+			    memcmp(slot->key, msgs[i].key, this->key_size)) {
+				if (n)
+					break;
+				r = aes_gcm_slot_setkey(this, slot,
+							msgs[i].key);
+				if (r) {
+					msgs[i].err = r;
+					err = r;
+					n--;
+					continue;
+				}
+			}
+			req = &slot->reqs[n];
+			req->batch = &batch;
+			aes_gcm_request_prepare(this, slot, req, &msgs[i],
+						decrypt);
+			atomic_inc(&batch.pending);
+			if (decrypt)
+				r = crypto_aead_decrypt(req->req);
+			else
+				r = crypto_aead_encrypt(req->req);
+			if (r != -EINPROGRESS && r != -EBUSY)
+				aes_gcm_request_complete(req, r);
+		}
+
+		if (!atomic_dec_and_test(&batch.pending))
+			wait_for_completion(&batch.done);
+		if (batch.err && !err)
+			err = batch.err;
 	}
-exit:
-	if (req)
-		aead_request_free(req);
+	aes_gcm_slot_put(slot);
+	return err;
+}
+
+int aes_gcm_cipher_encrypt_many(struct aead_cipher *ac, struct aead_msg *msgs,
+				int nr)
+{
+	struct aes_gcm_cipher *this =
+		container_of(ac, struct aes_gcm_cipher, aead_cipher);
+
+	return aes_gcm_cipher_submit(this, msgs, nr, false);
+}
+
+int aes_gcm_cipher_decrypt_many(struct aead_cipher *ac, struct aead_msg *msgs,
+				int nr)
+{
+	struct aes_gcm_cipher *this =
+		container_of(ac, struct aes_gcm_cipher, aead_cipher);
+
+	return aes_gcm_cipher_submit(this, msgs, nr, true);
+}
+
+int aes_gcm_cipher_encrypt(struct aead_cipher *ac, char *data, int len,
+			   char *key, char *iv, char *mac, uint64_t seq,
+			   char *out)
+{
+	int r;
+	struct aead_msg msg = { .data = data,
+				.out = out,
+				.len = len,
+				.key = key,
+				.iv = iv,
+				.mac = mac,
+				.seq = seq };
+#if defined(DEBUG)
+	char mac_hex[(AES_GCM_AUTH_SIZE << 1) + 1] = { 0 };
+	char key_hex[(AES_GCM_KEY_SIZE << 1) + 1] = { 0 };
+#endif
+
+	r = aes_gcm_cipher_encrypt_many(ac, &msg, 1);
+	if (r)
+		DMERR("gcm(aes) encrypt error");
 #if defined(DEBUG)
 	btox(key_hex, key, AES_GCM_KEY_SIZE << 1);
-	btox(iv_hex, riv, AES_GCM_IV_SIZE << 1);
 	btox(mac_hex, mac, AES_GCM_AUTH_SIZE << 1);
-	DMDEBUG("gcm(aes) encrypted, key:%s, iv:%s, mac:%s, seq:%llu, len:%u",
-		key_hex, iv_hex, mac_hex, seq, len);
+	DMDEBUG("gcm(aes) encrypted, key:%s, mac:%s, seq:%llu, len:%u",
+		key_hex, mac_hex, seq, len);
 #endif
-	mutex_unlock(&this->lock);
 	return r;
 }
 
@@ -98,109 +247,102 @@ int aes_gcm_cipher_decrypt(struct aead_cipher *ac, char *data, int len,
 			   char *key, char *iv, char *mac, uint64_t seq,
 			   char *out)
 {
-	int r = 0;
-	char *riv;
-	struct aead_request *req;
-	char zero_iv[AES_GCM_IV_SIZE] = { 0 };
-	char mac_hex[(AES_GCM_AUTH_SIZE << 1) + 1] = { 0 };
-	char key_hex[(AES_GCM_KEY_SIZE << 1) + 1] = { 0 };
-	char iv_hex[(AES_GCM_IV_SIZE << 1) + 1] = { 0 };
-	struct scatterlist sg_in[AEAD_MSG_NR_PART], sg_out[AEAD_MSG_NR_PART];
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aes_gcm_cipher *this =
-		container_of(ac, struct aes_gcm_cipher, aead_cipher);
-	if (iv)
-		riv = iv;
-	else
-		riv = zero_iv;
+	struct aead_msg msg = { .data = data,
+				.out = out,
+				.len = len,
+				.key = key,
+				.iv = iv,
+				.mac = mac,
+				.seq = seq };
+
+	return aes_gcm_cipher_decrypt_many(ac, &msg, 1);
+}
 
-	sg_init_table(sg_in, AEAD_MSG_NR_PART);
-	sg_set_buf(&sg_in[0], &seq, sizeof(uint64_t));
-	sg_set_buf(&sg_in[1], riv, this->iv_size);
-	sg_set_buf(&sg_in[2], data, len);
-	sg_set_buf(&sg_in[3], mac, this->auth_size);
+static void aes_gcm_slot_destroy(struct aes_gcm_slot *slot)
+{
+	int i;
 
-	sg_init_table(sg_out, AEAD_MSG_NR_PART);
-	sg_set_buf(&sg_out[0], &seq, sizeof(uint64_t));
-	sg_set_buf(&sg_out[1], riv, this->iv_size);
-	sg_set_buf(&sg_out[2], out, len);
-	sg_set_buf(&sg_out[3], mac, this->auth_size);
+	if (!slot)
+		return;
 
-	r = mutex_lock_interruptible(&this->lock);
-	if (r)
-		goto exit;
+	for (i = 0; i < AEAD_ENGINE_QUEUE_DEPTH; i++)
+		aead_request_free(slot->reqs[i].req);
+	if (!IS_ERR_OR_NULL(slot->tfm))
+		crypto_free_aead(slot->tfm);
+	kfree(slot);
+}
 
-	crypto_aead_setauthsize(this->tfm, this->auth_size);
-	req = aead_request_alloc(this->tfm, GFP_KERNEL);
-	if (!req) {
-		DMERR("could not allocate aead request");
-		goto exit;
-	}
+static struct aes_gcm_slot *aes_gcm_slot_create(void)
+{
+	int i;
+	struct aes_gcm_slot *slot;
 
-	aead_request_set_crypt(req, sg_in, sg_out, len + this->auth_size, riv);
-	aead_request_set_ad(req, sizeof(uint64_t) + this->iv_size);
+	slot = kzalloc(sizeof(struct aes_gcm_slot), GFP_KERNEL);
+	if (!slot)
+		return NULL;
 
-	r = crypto_aead_setkey(this->tfm, key, this->key_size);
-	if (r) {
-		DMERR("gcm(aes) key could not be set");
-		goto exit;
+	slot->tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
+	if (IS_ERR(slot->tfm)) {
+		DMERR("could not allocate aead handler");
+		goto bad;
 	}
-
-	aead_request_set_callback(
-		req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
-		crypto_req_done, &wait);
-	r = crypto_wait_req(crypto_aead_decrypt(req), &wait);
-	if (r == -EBADMSG) {
-		btox(key_hex, key, AES_GCM_KEY_SIZE << 1);
-		btox(iv_hex, riv, AES_GCM_IV_SIZE << 1);
-		btox(mac_hex, mac, AES_GCM_AUTH_SIZE << 1);
-		DMWARN("gcm(aes) authentication failed, key:%s, iv:%s, mac:%s, "
-		       "seq:%llu",
-		       key_hex, iv_hex, mac_hex, seq);
-		goto exit;
-	} else if (r) {
-		DMERR("gcm(aes) decryption error");
-		goto exit;
+	crypto_aead_setauthsize(slot->tfm, AES_GCM_AUTH_SIZE);
+
+	for (i = 0; i < AEAD_ENGINE_QUEUE_DEPTH; i++) {
+		slot->reqs[i].req = aead_request_alloc(slot->tfm, GFP_KERNEL);
+		if (!slot->reqs[i].req) {
+			DMERR("could not allocate aead request");
+			goto bad;
+		}
 	}
-#if defined(DEBUG)
-	btox(key_hex, key, AES_GCM_KEY_SIZE << 1);
-	btox(iv_hex, riv, AES_GCM_IV_SIZE << 1);
-	btox(mac_hex, mac, AES_GCM_AUTH_SIZE << 1);
-	DMDEBUG("gcm(aes) decrypted, key:%s, iv:%s, mac:%s, seq:%llu, len:%u",
-		key_hex, iv_hex, mac_hex, seq, len);
-#endif
-exit:
-	if (req)
-		aead_request_free(req);
-
-	mutex_unlock(&this->lock);
-	return r;
+	mutex_init(&slot->lock);
+	return slot;
+bad:
+	aes_gcm_slot_destroy(slot);
+	return NULL;
 }
 
 void aes_gcm_cipher_destroy(struct aead_cipher *ac)
 {
+	int i;
 	struct aes_gcm_cipher *this =
 		container_of(ac, struct aes_gcm_cipher, aead_cipher);
-	crypto_free_aead(this->tfm);
+
+	if (this->slots) {
+		for (i = 0; i < this->nr_slots; i++)
+			aes_gcm_slot_destroy(this->slots[i]);
+		kfree(this->slots);
+	}
 	kfree(this);
 }
 
 int aes_gcm_cipher_init(struct aes_gcm_cipher *this)
 {
-	this->tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
-	if (IS_ERR(this->tfm)) {
-		DMERR("could not allocate aead handler");
+	int i;
+	struct crypto_aead *tfm;
+
+	this->nr_slots = num_online_cpus();
+	this->slots = kcalloc(this->nr_slots, sizeof(struct aes_gcm_slot *),
+			      GFP_KERNEL);
+	if (!this->slots)
 		return -ENOMEM;
+
+	for (i = 0; i < this->nr_slots; i++) {
+		this->slots[i] = aes_gcm_slot_create();
+		if (!this->slots[i])
+			return -ENOMEM;
 	}
 
-	mutex_init(&this->lock);
-	this->block_size = crypto_aead_blocksize(this->tfm);
-	this->auth_size = crypto_aead_authsize(this->tfm);
-	this->iv_size = crypto_aead_ivsize(this->tfm);
+	tfm = this->slots[0]->tfm;
+	this->block_size = crypto_aead_blocksize(tfm);
+	this->auth_size = crypto_aead_authsize(tfm);
+	this->iv_size = crypto_aead_ivsize(tfm);
 	this->key_size = AES_GCM_KEY_SIZE;
 
 	this->aead_cipher.encrypt = aes_gcm_cipher_encrypt;
 	this->aead_cipher.decrypt = aes_gcm_cipher_decrypt;
+	this->aead_cipher.encrypt_many = aes_gcm_cipher_encrypt_many;
+	this->aead_cipher.decrypt_many = aes_gcm_cipher_decrypt_many;
 	this->aead_cipher.destroy = aes_gcm_cipher_destroy;
 	return 0;
 }
@@ -210,7 +352,7 @@ struct aead_cipher *aes_gcm_cipher_create()
 	int err = 0;
 	struct aes_gcm_cipher *this;
 
-	this = kmalloc(sizeof(struct aes_gcm_cipher), GFP_KERNEL);
+	this = kzalloc(sizeof(struct aes_gcm_cipher), GFP_KERNEL);
 	if (!this)
 		goto bad;
 
@@ -221,7 +363,7 @@ struct aead_cipher *aes_gcm_cipher_create()
 	return &this->aead_cipher;
 bad:
 	if (this)
-		kfree(this);
+		aes_gcm_cipher_destroy(&this->aead_cipher);
 	return NULL;
 }
 
@@ -19,37 +19,118 @@ size_t disk_array_entry_offset(struct disk_array *this, size_t index)
 	return (index % this->entries_per_block) * this->entry_size;
 }
 
-int disk_array_set(struct disk_array *this, size_t index, void *entry)
+/*
+ * Save the content of a frozen block before its first change, so that the
+ * running checkpoint still copies the block as it was at the freeze. If no
+ * memory is left, the checkpoint gets the newer content, which the next one
+ * copies again anyway.
+ */
+static void disk_array_cow(struct disk_array *this, size_t blk, void *data)
+{
+	void *copy = kmalloc(METADATA_BLOCK_SIZE, GFP_NOIO);
+
+	if (!copy || xa_reserve(&this->cow, blk, GFP_NOIO)) {
+		kfree(copy);
+		return;
+	}
+	xa_lock(&this->cow);
+	if (test_bit(blk, this->frozen)) {
+		memcpy(copy, data, METADATA_BLOCK_SIZE);
+		__xa_store(&this->cow, blk, copy, GFP_ATOMIC);
+		// store the copy before the reader can see the block thawed
+		smp_mb__before_atomic();
+		clear_bit(blk, this->frozen);
+		copy = NULL;
+	} else {
+		__xa_erase(&this->cow, blk);
+	}
+	xa_unlock(&this->cow);
+	kfree(copy);
+}
+
+/*
+ * Get the decrypted buffer of a block about to change, saving it first if a
+ * running checkpoint still has to copy it.
+ */
+static void *disk_array_write_begin(struct disk_array *this, size_t blk,
+				    struct dm_buffer **bp)
 {
-	struct dm_buffer *b = NULL;
 	void *data = NULL;
 	struct meta_aux_data *aux = NULL;
 	struct skcipher *sc = this->skcipher;
 	uint64_t seq;
 
-	if (index < 0 || index >= this->nr_entry)
-		return -EINVAL;
-
-	data = dm_bufio_get(this->bc, disk_array_entry_block(this, index), &b);
+	data = dm_bufio_get(this->bc, this->start + blk, bp);
 	if (!IS_ERR_OR_NULL(data))
-		goto copy_data;
+		goto cow;
 
-	data = dm_bufio_read(this->bc, disk_array_entry_block(this, index), &b);
+	data = dm_bufio_read(this->bc, this->start + blk, bp);
 	if (IS_ERR_OR_NULL(data)) {
 		DMERR("disk_array_set dm_bufio_read failed");
-		return data ? PTR_ERR(data) : -EBUSY;
+		return data ? data : ERR_PTR(-EBUSY);
 	}
-	aux = dm_bufio_get_aux_data(b);
+	aux = dm_bufio_get_aux_data(*bp);
 	aux->disk_array = this;
-	seq = dm_bufio_get_block_number(b);
+	seq = dm_bufio_get_block_number(*bp);
 	sc->decrypt(sc, data, METADATA_BLOCK_SIZE, this->key, NULL, seq, data);
-copy_data:
+cow:
+	if (test_bit(blk, this->frozen))
+		disk_array_cow(this, blk, data);
+	return data;
+}
+
+static void disk_array_write_end(struct disk_array *this, size_t blk,
+				 struct dm_buffer *b)
+{
+	dm_bufio_mark_buffer_dirty(b);
+	set_bit(blk, this->dirty);
+	dm_bufio_release(b);
+}
+
+int disk_array_set(struct disk_array *this, size_t index, void *entry)
+{
+	struct dm_buffer *b = NULL;
+	void *data = NULL;
+	size_t blk = index / this->entries_per_block;
+
+	if (index < 0 || index >= this->nr_entry)
+		return -EINVAL;
+
+	data = disk_array_write_begin(this, blk, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
 	data += disk_array_entry_offset(this, index);
 	memcpy(data, entry, this->entry_size);
+	disk_array_write_end(this, blk, b);
+	return 0;
+}
 
-	dm_bufio_mark_buffer_dirty(b);
+// set count consecutive entries from index on, each block is read once
+int disk_array_set_range(struct disk_array *this, size_t index, size_t count,
+			 void *entries)
+{
+	struct dm_buffer *b = NULL;
+	void *data = NULL;
+	size_t blk, nr;
 
-	dm_bufio_release(b);
+	if (index >= this->nr_entry || count > this->nr_entry - index)
+		return -EINVAL;
+
+	while (count) {
+		blk = index / this->entries_per_block;
+		nr = min(count, this->entries_per_block -
+					index % this->entries_per_block);
+		data = disk_array_write_begin(this, blk, &b);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		memcpy(data + disk_array_entry_offset(this, index), entries,
+		       nr * this->entry_size);
+		disk_array_write_end(this, blk, b);
+
+		index += nr;
+		count -= nr;
+		entries += nr * this->entry_size;
+	}
 	return 0;
 }
 
@@ -113,6 +194,7 @@ int disk_array_format(struct disk_array *this, bool value)
 		memset(data, value ? 0xff : 0, cycle);
 
 		dm_bufio_mark_buffer_dirty(b);
+		set_bit(shift, this->dirty);
 		dm_bufio_release(b);
 
 		total -= cycle;
@@ -121,13 +203,95 @@ int disk_array_format(struct disk_array *this, bool value)
 	return 0;
 }
 
+/*
+ * Start a checkpoint: the dirty blocks become frozen until read_frozen
+ * copies them, sets after this save the old content of a frozen block first.
+ */
+void disk_array_freeze(struct disk_array *this, unsigned long *snapshot)
+{
+	size_t i;
+
+	// sets may race with us, never lose a bit by clearing word by word
+	for (i = 0; i < BITS_TO_LONGS(this->nr_block); i++) {
+		snapshot[i] = xchg(&this->dirty[i], 0);
+		WRITE_ONCE(this->frozen[i], snapshot[i]);
+	}
+	smp_mb();
+}
+
+int disk_array_read_frozen(struct disk_array *this, size_t blk, void *out)
+{
+	struct dm_buffer *b = NULL;
+	struct meta_aux_data *aux = NULL;
+	struct skcipher *sc = this->skcipher;
+	void *data = NULL, *copy = NULL;
+	uint64_t seq;
+
+	if (!test_bit(blk, this->frozen))
+		goto copy_data;
+
+	data = dm_bufio_get(this->bc, this->start + blk, &b);
+	if (!IS_ERR_OR_NULL(data))
+		goto copy_data;
+
+	data = dm_bufio_read(this->bc, this->start + blk, &b);
+	if (IS_ERR_OR_NULL(data)) {
+		DMERR("disk_array_read_frozen dm_bufio_read failed");
+		clear_bit(blk, this->frozen);
+		return data ? PTR_ERR(data) : -EBUSY;
+	}
+	aux = dm_bufio_get_aux_data(b);
+	aux->disk_array = this;
+	seq = dm_bufio_get_block_number(b);
+	sc->decrypt(sc, data, METADATA_BLOCK_SIZE, this->key, NULL, seq, data);
+copy_data:
+	// either we copy the block still frozen, or a set has saved it
+	xa_lock(&this->cow);
+	if (test_bit(blk, this->frozen)) {
+		memcpy(out, data, METADATA_BLOCK_SIZE);
+		// a set seeing the block thawed must not change it under us
+		smp_mb__before_atomic();
+		clear_bit(blk, this->frozen);
+	} else {
+		copy = __xa_erase(&this->cow, blk);
+	}
+	xa_unlock(&this->cow);
+	if (b)
+		dm_bufio_release(b);
+
+	if (copy) {
+		memcpy(out, copy, METADATA_BLOCK_SIZE);
+		kfree(copy);
+	} else if (!b) {
+		return -ENOENT;
+	}
+	return 0;
+}
+
 int disk_array_init(struct disk_array *this, struct dm_bufio_client *bc,
 		    char *key, dm_block_t start, size_t nr_entry,
 		    size_t entry_size)
 {
+	this->nr_block = __disk_array_blocks(nr_entry, entry_size,
+					     METADATA_BLOCK_SIZE);
+	// the other copy may be stale after a crash, copy it all once
+	this->dirty = bitmap_zalloc(this->nr_block, GFP_KERNEL);
+	if (!this->dirty)
+		return -ENOMEM;
+	bitmap_fill(this->dirty, this->nr_block);
+	this->frozen = bitmap_zalloc(this->nr_block, GFP_KERNEL);
+	if (!this->frozen) {
+		bitmap_free(this->dirty);
+		return -ENOMEM;
+	}
+	xa_init(&this->cow);
+
 	this->skcipher = aes_cbc_cipher_create();
-	if (!this->skcipher)
+	if (!this->skcipher) {
+		bitmap_free(this->frozen);
+		bitmap_free(this->dirty);
 		return -EAGAIN;
+	}
 
 	this->start = start;
 	this->nr_entry = nr_entry;
@@ -137,8 +301,11 @@ int disk_array_init(struct disk_array *this, struct dm_bufio_client *bc,
 	memcpy(this->key, key, AES_CBC_KEY_SIZE);
 
 	this->set = disk_array_set;
+	this->set_range = disk_array_set_range;
 	this->get = disk_array_get;
 	this->format = disk_array_format;
+	this->freeze = disk_array_freeze;
+	this->read_frozen = disk_array_read_frozen;
 	return 0;
 }
 
@@ -162,8 +329,16 @@ struct disk_array *disk_array_create(struct dm_bufio_client *bc, char *key,
 
 void disk_array_destroy(struct disk_array *this)
 {
+	unsigned long blk;
+	void *copy;
+
 	if (!IS_ERR_OR_NULL(this)) {
 		this->skcipher->destroy(this->skcipher);
+		xa_for_each(&this->cow, blk, copy)
+			kfree(copy);
+		xa_destroy(&this->cow);
+		bitmap_free(this->frozen);
+		bitmap_free(this->dirty);
 		kfree(this);
 	}
 }
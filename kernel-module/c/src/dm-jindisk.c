@@ -10,8 +10,8 @@
 #include <linux/spinlock.h>
 #include <linux/ioctl.h>
 #include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
 
-#include "../include/async.h"
 #include "../include/dm_jindisk.h"
 #include "../include/metadata.h"
 #include "../include/segment_allocator.h"
@@ -21,95 +21,144 @@ size_t NR_SEGMENT;
 struct dm_jindisk *jindisk = NULL;
 struct disk_statistics disk_counter = { 0 };
 
-void bio_list_add_safe(struct dm_jindisk *jindisk, struct bio_list *list,
-		       struct bio *bio)
-{
-	unsigned long flags;
+static unsigned int data_cache_blocks = DEFAULT_DATA_CACHE_BLOCKS;
+module_param(data_cache_blocks, uint, 0444);
+MODULE_PARM_DESC(data_cache_blocks,
+		 "Number of decrypted 4KiB blocks to cache, 0 to disable");
 
-	spin_lock_irqsave(&jindisk->req_lock, flags);
-	bio_list_add(list, bio);
-	spin_unlock_irqrestore(&jindisk->req_lock, flags);
-}
+static bool enable_readahead = true;
+module_param(enable_readahead, bool, 0444);
+MODULE_PARM_DESC(enable_readahead,
+		 "Prefetch sequential reads into the data cache");
 
-void bio_list_take_safe(struct dm_jindisk *jindisk, struct bio_list *dst,
-			struct bio_list *src)
-{
-	unsigned long flags;
+static int segment_buffers = POOL_SIZE;
+module_param(segment_buffers, int, 0444);
+MODULE_PARM_DESC(segment_buffers,
+		 "Number of 4MiB write buffers, writers stall when all are dirty");
 
-	bio_list_init(dst);
-	spin_lock_irqsave(&jindisk->req_lock, flags);
-	bio_list_merge(dst, src);
-	bio_list_init(src);
-	spin_unlock_irqrestore(&jindisk->req_lock, flags);
-}
+static unsigned int checkpoint_interval = CHECKPOINT_INTERVAL;
+module_param(checkpoint_interval, uint, 0644);
+MODULE_PARM_DESC(checkpoint_interval,
+		 "Seconds between background checkpoints, 0 to only take "
+		 "them when the journal or the changed metadata grows");
 
 void defer_bio(struct dm_jindisk *jindisk, struct bio *bio)
 {
-	bio_list_add_safe(jindisk, &jindisk->deferred_bios, bio);
-	schedule_work(&jindisk->deferred_bio_worker);
+	int cpu;
+	unsigned long flags;
+	struct jindisk_queue *queue;
+	struct jindisk_io *io = dm_per_bio_data(bio, sizeof(struct jindisk_io));
+
+	io->bio = bio;
+	io->queued_ns = ktime_get_ns();
+
+	cpu = get_cpu();
+	queue = per_cpu_ptr(jindisk->queues, cpu);
+	spin_lock_irqsave(&queue->lock, flags);
+	if (bio_op(bio) == REQ_OP_READ) {
+		bio_list_add(&queue->reads, bio);
+		queue->nr_reads += 1;
+	} else {
+		bio_list_add(&queue->writes, bio);
+		queue->nr_writes += 1;
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+	queue_work_on(cpu, jindisk->queue_wq, &queue->work);
+	put_cpu();
 }
 
-void jindisk_block_io(void *iocb, struct diskio_ctx *ctx)
+void jindisk_block_io(io_engine_notify_fn iocb, struct diskio_ctx *ctx)
 {
-	unsigned long sync_error_bits = 0;
-	struct dm_io_request req = { .bi_op = req.bi_op_flags = ctx->bi_op,
-				     .mem.type = ctx->mem_type,
-				     .mem.offset = 0,
-				     .mem.ptr.addr = ctx->io_buffer,
-				     .notify.fn = iocb,
-				     .notify.context = ctx,
-				     .client = jindisk->io_client };
-	struct dm_io_region region = {
+	int err;
+	struct io_request req = {
+		.bi_op = ctx->bi_op,
 		.bdev = jindisk->raw_dev->bdev,
 		.sector = (jindisk->meta->superblock->data_start +
 			   ctx->blk_start) *
 			  SECTORS_PER_BLOCK,
-		.count = (ctx->blk_count) * SECTORS_PER_BLOCK
+		.count = (ctx->blk_count) * SECTORS_PER_BLOCK,
+		.mem_type = ctx->mem_type,
+		.mem.addr = ctx->io_buffer,
+		.notify = iocb,
+		.context = ctx,
 	};
 
-	dm_io(&req, 1, &region, &sync_error_bits);
-	if (sync_error_bits)
+	if (ctx->mem_type == DM_IO_PAGE_LIST)
+		req.mem.pl = ctx->pages;
+	err = jindisk->io_engine->submit(jindisk->io_engine, &req);
+	if (err)
 		DMERR("segment buffer io error");
 }
 
+// zero a block that failed to read rather than return its ciphertext
+static void read_fail_block(struct diskio_ctx *ctx, int i, blk_status_t status)
+{
+	memset(page_address(ctx->infos[i].page), 0, DATA_BLOCK_SIZE);
+	if (ctx->status)
+		WRITE_ONCE(*ctx->status, status);
+}
+
+/*
+ * Ciphertext was read straight into the bio pages, so every block is
+ * decrypted in place and there is nothing to copy back afterwards.
+ */
 void decrypt_work(struct work_struct *ws)
 {
-	int i, err;
+	int i;
+	struct aead_msg *msgs;
 	struct diskio_ctx *ctx = container_of(ws, struct diskio_ctx, work);
 
 	DMDEBUG("decrypt_work blk_count:%u", ctx->blk_count);
+	msgs = ctx->msgs;
+	for (i = 0; i < ctx->blk_count; ++i) {
+		struct record *r = ctx->infos[i].record;
+		void *data = page_address(ctx->infos[i].page);
+
+		memset(&msgs[i], 0, sizeof(struct aead_msg));
+		msgs[i].data = data;
+		msgs[i].out = data;
+		msgs[i].len = DATA_BLOCK_SIZE;
+		msgs[i].key = r->key;
+		msgs[i].mac = r->mac;
+		msgs[i].seq = r->pba;
+	}
+	jindisk->cipher->decrypt_many(jindisk->cipher, msgs, ctx->blk_count);
 	for (i = 0; i < ctx->blk_count; ++i) {
-		struct record *r = ctx->infos[i]->record;
-		void *ciphertext = (char *)ctx->io_buffer + i * DATA_BLOCK_SIZE;
-		void *data_out = ctx->infos[i]->page_addr;
-
-		err = jindisk->cipher->decrypt(jindisk->cipher, ciphertext,
-					       DATA_BLOCK_SIZE, r->key, NULL,
-					       r->mac, r->pba, data_out);
-		if (err)
+		if (msgs[i].err) {
 			DMERR("decrypt data failed lba:%llu pba:%llu err:%d",
-			      ctx->infos[i]->lba, r->pba, err);
-
-		DMDEBUG("decrypt lba:%llu pba:%llu", ctx->infos[i]->lba,
-			r->pba);
-		record_destroy(r);
-		kfree(ctx->infos[i]);
+			      ctx->infos[i].lba, msgs[i].seq, msgs[i].err);
+			read_fail_block(ctx, i,
+					msgs[i].err == -EBADMSG ?
+						BLK_STS_PROTECTION :
+						BLK_STS_IOERR);
+		} else if (jindisk->data_cache)
+			jindisk->data_cache->put(jindisk->data_cache,
+						 ctx->infos[i].lba,
+						 msgs[i].out,
+						 ctx->infos[i].gen);
+		DMDEBUG("decrypt lba:%llu pba:%llu", ctx->infos[i].lba,
+			msgs[i].seq);
 	}
-	vfree(ctx->io_buffer);
-	kfree(ctx->infos);
 
 	if (ctx->wait && atomic_dec_and_test(ctx->cnt))
 		complete(ctx->wait);
 
-	kfree(ctx);
+	mempool_free(ctx, jindisk->diskio_ctx_pool);
 }
 
-void read_iocb(unsigned long error, void *ctx)
+void read_iocb(int error, void *ctx)
 {
 	struct diskio_ctx *ictx = ctx;
+	int i;
 
 	if (error) {
-		DMERR("read_iocb io error");
+		DMERR("read_iocb io error pba:%llu count:%d err:%d",
+		      ictx->blk_start, ictx->blk_count, error);
+		for (i = 0; i < ictx->blk_count; i++)
+			read_fail_block(ictx, i, BLK_STS_IOERR);
+		if (ictx->wait && atomic_dec_and_test(ictx->cnt))
+			complete(ictx->wait);
+		mempool_free(ictx, jindisk->diskio_ctx_pool);
 		return;
 	}
 
@@ -120,10 +169,8 @@ void read_iocb(unsigned long error, void *ctx)
 void jindisk_read_blocks(dm_block_t pba, size_t count, void *buffer,
 			 enum dm_io_mem_type mem_type, void *ctx)
 {
-	struct diskio_ctx *ictx = ctx;
-
-	if (!ctx)
-		ictx = kzalloc(sizeof(struct diskio_ctx), GFP_KERNEL);
+	struct diskio_ctx sync_ctx = { 0 };
+	struct diskio_ctx *ictx = ctx ? ctx : &sync_ctx;
 
 	DMDEBUG("read_blocks dm-io start:%llu count:%lu", pba, count);
 	ictx->bi_op = REQ_OP_READ;
@@ -131,6 +178,8 @@ void jindisk_read_blocks(dm_block_t pba, size_t count, void *buffer,
 	ictx->blk_count = count;
 	ictx->io_buffer = buffer;
 	ictx->mem_type = mem_type;
+	if (mem_type == DM_IO_PAGE_LIST)
+		ictx->pages = buffer;
 
 	disk_counter.read_io_blocks += count;
 	disk_counter.read_io_count += 1;
@@ -138,39 +187,25 @@ void jindisk_read_blocks(dm_block_t pba, size_t count, void *buffer,
 		jindisk_block_io(read_iocb, ictx);
 	else
 		jindisk_block_io(NULL, ictx);
-
-	if (!ctx)
-		kfree(ictx);
 }
 
-void jindisk_write_blocks(dm_block_t pba, size_t count, void *buffer,
-			  enum dm_io_mem_type mem_type)
+/*
+ * Log the data blocks [pba, pba + count) to the journal, once their records
+ * are in the index.
+ */
+void jindisk_journal_blocks(dm_block_t pba, size_t count)
 {
-	struct diskio_ctx ctx = {
-		.bi_op = REQ_OP_WRITE,
-		.blk_start = pba,
-		.blk_count = count,
-		.io_buffer = buffer,
-		.mem_type = mem_type,
-	};
 #if ENABLE_JOURNAL
 	uint64_t i, ts;
 	dm_block_t lba, hba;
 	struct record d_record;
 	struct journal_region *journal;
 	struct journal_record j_record;
-#endif
-	DMDEBUG("write_blocks dm-io start:%llu count:%lu", pba, count);
-	jindisk_block_io(NULL, &ctx);
-	disk_counter.write_io_blocks += count;
-	disk_counter.write_io_count += 1;
 
-#if ENABLE_JOURNAL
-	hba = pba;
 	journal = jindisk->meta->journal;
 	ts = ktime_get_real_ns();
 	for (i = 0; i < count; i++) {
-		hba += i;
+		hba = pba + i;
 		jindisk->meta->rit->get(jindisk->meta->rit, hba, &lba);
 		jindisk->lsm_tree->search(jindisk->lsm_tree, lba, &d_record);
 
@@ -186,65 +221,103 @@ void jindisk_write_blocks(dm_block_t pba, size_t count, void *buffer,
 #endif
 }
 
-void merge_read_io(struct blk_info **blks, int start, int end,
-		   struct completion *wait, atomic_t *wait_cnt)
+void jindisk_write_blocks(dm_block_t pba, size_t count, void *buffer,
+			  enum dm_io_mem_type mem_type)
+{
+	struct diskio_ctx ctx = {
+		.bi_op = REQ_OP_WRITE,
+		.blk_start = pba,
+		.blk_count = count,
+		.io_buffer = buffer,
+		.mem_type = mem_type,
+	};
+
+	DMDEBUG("write_blocks dm-io start:%llu count:%lu", pba, count);
+	jindisk_block_io(NULL, &ctx);
+	disk_counter.write_io_blocks += count;
+	disk_counter.write_io_count += 1;
+	jindisk_journal_blocks(pba, count);
+}
+
+/*
+ * Write the data blocks [pba, pba + count) and call fn once they are on
+ * disk. Nothing is journaled, see jindisk_journal_blocks.
+ */
+void jindisk_write_blocks_async(dm_block_t pba, size_t count, void *buffer,
+				enum dm_io_mem_type mem_type,
+				io_engine_notify_fn fn, void *context)
+{
+	struct io_request req = {
+		.bi_op = REQ_OP_WRITE,
+		.bdev = jindisk->raw_dev->bdev,
+		.sector = (jindisk->meta->superblock->data_start + pba) *
+			  SECTORS_PER_BLOCK,
+		.count = count * SECTORS_PER_BLOCK,
+		.mem_type = mem_type,
+		.mem.addr = buffer,
+		.notify = fn,
+		.context = context,
+	};
+
+	DMDEBUG("write_blocks_async start:%llu count:%lu", pba, count);
+	disk_counter.write_io_blocks += count;
+	disk_counter.write_io_count += 1;
+	jindisk->io_engine->submit(jindisk->io_engine, &req);
+}
+
+// flush the volatile write cache of the underlying device
+int jindisk_flush_device(void)
+{
+	struct io_request req = {
+		.bi_op = REQ_OP_WRITE | REQ_PREFLUSH,
+		.bdev = jindisk->raw_dev->bdev,
+		.mem_type = DM_IO_KMEM,
+	};
+
+	return jindisk->io_engine->submit(jindisk->io_engine, &req);
+}
+
+/*
+ * blks[start..end] and their msgs live in the per-bio data of the bio being
+ * read, which outlives the io since the bio is only completed after all of
+ * them.
+ */
+void merge_read_io(struct blk_info *blks, struct aead_msg *msgs, int start,
+		   int end, struct completion *wait, atomic_t *wait_cnt,
+		   blk_status_t *status)
 {
 	struct diskio_ctx *ctx;
-	void *buffer;
 	int i, count;
 
 	count = end - start + 1;
-	ctx = kzalloc(sizeof(struct diskio_ctx), GFP_KERNEL);
-	buffer = vmalloc(count * DATA_BLOCK_SIZE);
-	if (!ctx || !buffer) {
-		DMERR("malloc diskio_ctx or buffer failed lba:%llu count:%d",
-		      blks[start]->lba, count);
-		goto err;
-	}
-	ctx->infos = kzalloc(count * sizeof(struct blk_info *), GFP_KERNEL);
-	if (!ctx->infos) {
-		DMERR("kzalloc ctx->infos failed lba:%llu count:%d",
-		      blks[start]->lba, count);
-		goto err;
+	ctx = mempool_alloc(jindisk->diskio_ctx_pool, GFP_NOIO);
+	memset(ctx, 0, sizeof(struct diskio_ctx));
+	for (i = start; i <= end; ++i) {
+		blks[i].pl.page = blks[i].page;
+		blks[i].pl.next = (i < end) ? &blks[i + 1].pl : NULL;
 	}
-	for (i = 0; i < count; ++i)
-		ctx->infos[i] = blks[start + i];
-
+	ctx->infos = &blks[start];
+	ctx->msgs = &msgs[start];
 	ctx->wait = wait;
 	ctx->cnt = wait_cnt;
+	ctx->status = status;
 
 	atomic_inc(wait_cnt);
-	jindisk_read_blocks(blks[start]->record->pba, count, buffer, DM_IO_VMA,
-			    ctx);
-	return;
-err:
-	if (ctx)
-		kfree(ctx);
-	if (buffer)
-		vfree(buffer);
-	for (i = start; i < count; ++i) {
-		record_destroy(blks[i]->record);
-		kfree(blks[i]);
-	}
+	jindisk_read_blocks(blks[start].record->pba, count, &blks[start].pl,
+			    DM_IO_PAGE_LIST, ctx);
 }
 
-void read_small_block(uint32_t lba, struct memtable *results,
-		      struct bio_vec *bv)
+void read_small_block(uint32_t lba, struct record *old, struct bio_vec *bv)
 {
 	int err = 0;
 	void *buffer = NULL;
 	void *data_out;
-	struct record *old;
 
-	if (!results || !bv)
+	if (!bv)
 		return;
 
 	data_out = page_address(bv->bv_page);
-	buffer = kzalloc(DATA_BLOCK_SIZE, GFP_KERNEL);
-	if (!buffer) {
-		DMERR("read_small_block kzalloc buffer failed");
-		return;
-	}
+	buffer = page_address(mempool_alloc(jindisk->page_pool, GFP_NOIO));
 
 	err = jindisk->seg_buffer->query_block(jindisk->seg_buffer, lba,
 					       buffer);
@@ -253,8 +326,7 @@ void read_small_block(uint32_t lba, struct memtable *results,
 		goto copy_data;
 	}
 
-	err = results->get(results, lba, (void **)&old);
-	if (err) {
+	if (!old || old->pba == INF_ADDR) {
 		DMDEBUG("read_small_block found nodata lba:%u", lba);
 		goto err;
 	}
@@ -266,42 +338,51 @@ copy_data:
 	memcpy((char *)data_out + bv->bv_offset, (char *)buffer + bv->bv_offset,
 	       bv->bv_len);
 err:
-	kfree(buffer);
+	mempool_free(virt_to_page(buffer), jindisk->page_pool);
 	return;
 }
 
+/*
+ * The index lookup fills rd->records and rd->found, and the blocks to read
+ * are gathered in rd->blks, so a read needs no per-block allocation.
+ */
 void jindisk_do_read(struct bio *bio)
 {
-	int range_start, range_end;
+	int i, range_start, range_end;
 	struct completion wait;
 	atomic_t wait_cnt;
-	struct memtable *results;
+	blk_status_t status = BLK_STS_OK;
+	struct jindisk_read *rd = mempool_alloc(jindisk->read_pool, GFP_NOIO);
+	struct blk_info *blks = rd->blks;
+	struct block_cache *cache = jindisk->data_cache;
+	uint64_t gens[MAX_NR_FETCH];
 	dm_block_t start = bio_to_lba(bio);
 	int count = DIV_ROUND_UP(bio->bi_iter.bi_size, DATA_BLOCK_SIZE);
-	int io_count = 0;
-	struct blk_info **blks =
-		kzalloc(count * sizeof(struct blk_info *), GFP_KERNEL);
+	int io_count = 0, hits = 0;
 
 	DMDEBUG("jindisk read request start:%llu count:%d", start, count);
 	disk_counter.read_req_blocks += count;
-	if (!blks) {
-		DMERR("jindisk_do_read kzalloc blk_info array failed");
-		goto out;
-	}
 
-	results = jindisk->lsm_tree->range_search(jindisk->lsm_tree, start,
-						  start + count - 1);
+	/* must be sampled before the index is looked up, see block_cache */
+	for (i = 0; cache && i < count; i++)
+		gens[i] = cache->generation(cache, start + i);
+
+	jindisk->lsm_tree->range_search(jindisk->lsm_tree, start, count,
+					rd->records, rd->found);
 	while (bio->bi_iter.bi_size) {
 		struct bio_vec bv = bio_iter_iovec(bio, bio->bi_iter);
 		dm_block_t lba = bio_to_lba(bio);
 		void *data_out = page_address(bv.bv_page);
 		int err = 0;
-		struct record *old;
+		struct record *old = NULL;
+
+		if (test_bit(lba - start, rd->found))
+			old = &rd->records[lba - start];
 
 		if (bio->bi_iter.bi_size < DATA_BLOCK_SIZE) {
 			DMWARN("read < 4K lba:%llu offset:%d len:%d", lba,
 			       bv.bv_offset, bv.bv_len);
-			read_small_block(lba, results, &bv);
+			read_small_block(lba, old, &bv);
 			break;
 		}
 		err = jindisk->seg_buffer->query_block(jindisk->seg_buffer, lba,
@@ -309,25 +390,26 @@ void jindisk_do_read(struct bio *bio)
 		if (!err)
 			goto next;
 
-		if (results)
-			err = results->get(results, lba, (void **)&old);
-		if (!results || err || old->pba == INF_ADDR)
-			goto next;
+		if (cache) {
+			if (!cache->get(cache, lba, data_out)) {
+				disk_counter.data_cache_hit += 1;
+				hits += 1;
+				goto next;
+			}
+			disk_counter.data_cache_miss += 1;
+		}
 
-		blks[io_count] = kzalloc(sizeof(struct blk_info), GFP_KERNEL);
-		if (!blks[io_count]) {
-			DMERR("kzalloc blk_info failed lba:%llu", lba);
+		if (!old || old->pba == INF_ADDR)
 			goto next;
-		}
-		blks[io_count]->lba = lba;
-		blks[io_count]->record = record_copy(old);
-		blks[io_count]->page_addr = data_out;
+
+		blks[io_count].lba = lba;
+		blks[io_count].record = old;
+		blks[io_count].page = bv.bv_page;
+		blks[io_count].gen = cache ? gens[lba - start] : 0;
 		io_count += 1;
 	next:
 		bio_advance_iter(bio, &bio->bi_iter, DATA_BLOCK_SIZE);
 	}
-	if (results)
-		results->destroy(results);
 
 	init_completion(&wait);
 	atomic_set(&wait_cnt, 0);
@@ -337,208 +419,434 @@ void jindisk_do_read(struct bio *bio)
 		if (range_end + 1 == io_count)
 			goto merge_io;
 
-		if (blks[range_end]->record->pba + 1 ==
-		    blks[range_end + 1]->record->pba)
+		if (blks[range_end].record->pba + 1 ==
+		    blks[range_end + 1].record->pba)
 			continue;
 	merge_io:
-		merge_read_io(blks, range_start, range_end, &wait, &wait_cnt);
+		merge_read_io(blks, rd->msgs, range_start, range_end, &wait,
+			      &wait_cnt, &status);
 		range_start = range_end + 1;
 	}
-	kfree(blks);
 
 	if (atomic_read(&wait_cnt))
 		wait_for_completion_io(&wait);
-out:
+	mempool_free(rd, jindisk->read_pool);
+
+	if (jindisk->readahead)
+		jindisk->readahead->observe(jindisk->readahead, start, count,
+					    hits);
+	bio->bi_status = status;
 	bio_endio(bio);
 }
 
-void async_read(void *ctx)
+void jindisk_read_work(struct work_struct *ws)
 {
-	jindisk_do_read(ctx);
-	up(&jindisk->max_reader);
+	struct jindisk_io *io = container_of(ws, struct jindisk_io, work);
+
+	disk_counter.read_queued_bios += 1;
+	disk_counter.read_queue_wait_ns += ktime_get_ns() - io->queued_ns;
+	jindisk_do_read(io->bio);
 }
 
-void jindisk_do_write(struct bio *bio)
+/*
+ * Flushes and fua writes are completed by the commit worker. It takes all
+ * of those waiting at once, commits and flushes the device a single time
+ * for them, bios arriving meanwhile wait for the next commit.
+ */
+static void jindisk_queue_commit(struct dm_jindisk *jindisk, struct bio *bio)
 {
-	down_read(&jindisk->meta->journal->valid_fields_lock);
-	jindisk->seg_buffer->push_bio(jindisk->seg_buffer, bio);
-	bio_endio(bio);
-	up_read(&jindisk->meta->journal->valid_fields_lock);
+	unsigned long flags;
+
+	spin_lock_irqsave(&jindisk->commit_lock, flags);
+	bio_list_add(&jindisk->commit_bios, bio);
+	spin_unlock_irqrestore(&jindisk->commit_lock, flags);
+	queue_work(jindisk->commit_wq, &jindisk->commit_work);
+}
+
+static void jindisk_commit_work(struct work_struct *ws)
+{
+	struct dm_jindisk *jindisk =
+		container_of(ws, struct dm_jindisk, commit_work);
+	struct bio_list bios;
+	struct bio *bio;
+	unsigned long flags;
+	blk_status_t status;
+	int err, flush_err;
+
+	spin_lock_irqsave(&jindisk->commit_lock, flags);
+	bios = jindisk->commit_bios;
+	bio_list_init(&jindisk->commit_bios);
+	spin_unlock_irqrestore(&jindisk->commit_lock, flags);
+	if (bio_list_empty(&bios))
+		return;
+
+	err = flush_and_commit(jindisk);
+	flush_err = jindisk_flush_device();
+	status = errno_to_blk_status(err ? err : flush_err);
+	disk_counter.commits += 1;
+	while ((bio = bio_list_pop(&bios))) {
+		disk_counter.commit_bios += 1;
+		if (!bio->bi_status)
+			bio->bi_status = status;
+		bio_endio(bio);
+	}
 }
 
-void async_write(void *ctx)
+void jindisk_do_write(struct bio *bio)
 {
-	jindisk_do_write(ctx);
+	int err;
+
+	down_read(&jindisk->meta->journal->valid_fields_lock);
+	if (bio_op(bio) == REQ_OP_DISCARD)
+		err = jindisk->seg_buffer->discard_bio(jindisk->seg_buffer,
+						       bio);
+	else
+		err = jindisk->seg_buffer->push_bio(jindisk->seg_buffer, bio);
+	up_read(&jindisk->meta->journal->valid_fields_lock);
+	if (err)
+		bio->bi_status = errno_to_blk_status(err);
+	if (!err && (bio->bi_opf & REQ_FUA))
+		jindisk_queue_commit(jindisk, bio);
+	else
+		bio_endio(bio);
 }
 
-void process_deferred_bios(struct work_struct *ws)
+/*
+ * Reads are handed to the per-cpu read workqueue, so their number in flight
+ * scales with the cpus submitting them. Writes are applied here, in the
+ * order they were queued on this cpu. Both classes are taken from the queue
+ * by weighted round-robin, so a read never waits behind more than
+ * WRITE_DISPATCH_WEIGHT buffered writes.
+ */
+void process_queued_bios(struct work_struct *ws)
 {
+	struct jindisk_queue *queue =
+		container_of(ws, struct jindisk_queue, work);
+	struct jindisk_io *io;
+	struct bio_list reads, writes;
 	struct bio *bio;
-	struct bio_list bios;
-	bool timeout = false;
+	unsigned long flags;
+	int i;
 
-	bio_list_take_safe(jindisk, &bios, &jindisk->deferred_bios);
-	while ((bio = bio_list_pop(&bios))) {
-		switch (bio_op(bio)) {
-		case REQ_OP_READ:
-			timeout = down_timeout(&jindisk->max_reader,
-					       msecs_to_jiffies(300));
-			go(async_read, bio);
+	bio_list_init(&reads);
+	bio_list_init(&writes);
+	for (;;) {
+		spin_lock_irqsave(&queue->lock, flags);
+		for (i = 0; i < READ_DISPATCH_WEIGHT; i++) {
+			bio = bio_list_pop(&queue->reads);
+			if (!bio)
+				break;
+			bio_list_add(&reads, bio);
+			queue->nr_reads -= 1;
+		}
+		for (i = 0; i < WRITE_DISPATCH_WEIGHT; i++) {
+			bio = bio_list_pop(&queue->writes);
+			if (!bio)
+				break;
+			bio_list_add(&writes, bio);
+			queue->nr_writes -= 1;
+		}
+		spin_unlock_irqrestore(&queue->lock, flags);
+
+		if (bio_list_empty(&reads) && bio_list_empty(&writes))
 			break;
-		case REQ_OP_WRITE:
+
+		while ((bio = bio_list_pop(&reads))) {
+			io = dm_per_bio_data(bio, sizeof(struct jindisk_io));
+			INIT_WORK(&io->work, jindisk_read_work);
+			queue_work(jindisk->read_wq, &io->work);
+		}
+		while ((bio = bio_list_pop(&writes))) {
+			io = dm_per_bio_data(bio, sizeof(struct jindisk_io));
+			disk_counter.write_queued_bios += 1;
+			disk_counter.write_queue_wait_ns +=
+				ktime_get_ns() - io->queued_ns;
 			jindisk_do_write(bio);
-			break;
 		}
 	}
 }
 
-void backup_metadata(struct block_device *bdev, dm_block_t dst, dm_block_t src,
-		     int blk_count, void *buffer, struct dm_io_client *client)
+#define BACKUP_CHUNK_BLOCKS 64
+#define BACKUP_CHUNK_SIZE (BACKUP_CHUNK_BLOCKS * METADATA_BLOCK_SIZE)
+
+struct backup_ctx {
+	struct completion done;
+	int error;
+};
+
+void backup_iocb(int error, void *context)
 {
-	int i;
-	unsigned long sync_error_bits;
-	struct dm_io_request req = {
-		.mem.type = DM_IO_KMEM,
-		.mem.offset = 0,
-		.mem.ptr.addr = buffer,
-		.notify.fn = NULL,
-		.client = client,
-	};
-	struct dm_io_region region = {
-		.bdev = bdev,
-		.count = SECTORS_PER_BLOCK,
+	struct backup_ctx *ctx = context;
+
+	ctx->error = error;
+	complete(&ctx->done);
+}
+
+static struct disk_array *checkpoint_field(struct metadata *meta, int field,
+					   dm_block_t *base, int *blk_count)
+{
+	switch (field) {
+	case DATA_SVT:
+		*base = meta->superblock->seg_validity_table_start;
+		*blk_count = meta->seg_validator->blk_count;
+		return meta->seg_validator->seg_validity_table->array;
+	case DATA_DST:
+		*base = meta->superblock->data_seg_table_start;
+		*blk_count = meta->dst->blk_count;
+		return meta->dst->array;
+	case DATA_RIT:
+		*base = meta->superblock->reverse_index_table_start;
+		*blk_count = meta->rit->blk_count;
+		return meta->rit->array;
+	case INDEX_SVT:
+		*base = meta->superblock->block_index_table_catalogue_start;
+		*blk_count = meta->bit_catalogue->bit_validity_table->blk_count;
+		return meta->bit_catalogue->bit_validity_table
+			->seg_validity_table->array;
+	case INDEX_BITC:
+		*base = meta->superblock->block_index_table_catalogue_start +
+			meta->bit_catalogue->bit_validity_table->blk_count *
+				NR_CHECKPOINT_PACKS;
+		*blk_count = meta->bit_catalogue->blk_count;
+		return meta->bit_catalogue->file_stats;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Write the frozen blocks of array to the other copy at dst, up to
+ * BACKUP_CHUNK_BLOCKS adjacent ones at a time. They are encrypted as the
+ * live copy at src would be written, and the buffer holds two chunks, so the
+ * next chunk is prepared while the previous one is being written. Blocks not
+ * written stay dirty for the next checkpoint.
+ */
+static int backup_frozen_blocks(struct disk_array *array, dm_block_t dst,
+				dm_block_t src, unsigned long *frozen,
+				void *buffer)
+{
+	int r, err = 0, chunk = 0;
+	bool writing = false;
+	size_t blk, i, nr, nr_block = array->nr_block;
+	char *data;
+	struct backup_ctx ctx;
+	struct skcipher *sc = array->skcipher;
+	struct io_engine *ie = jindisk->io_engine;
+	struct io_request req = {
+		.bdev = jindisk->raw_dev->bdev,
+		.bi_op = REQ_OP_WRITE,
+		.mem_type = DM_IO_VMA,
+		.notify = backup_iocb,
+		.context = &ctx,
 	};
 
-	for (i = 0; i < blk_count; i++) {
-		// read from src
-		req.bi_op = REQ_OP_READ;
-		region.sector = (src + i) * SECTORS_PER_BLOCK;
-		dm_io(&req, 1, &region, &sync_error_bits);
-		if (sync_error_bits)
-			DMERR("backup_metadata: dm_io read error");
-		// write to dst
-		sync_error_bits = 0;
-		req.bi_op = REQ_OP_WRITE;
-		region.sector = (dst + i) * SECTORS_PER_BLOCK;
-		dm_io(&req, 1, &region, &sync_error_bits);
-		if (sync_error_bits)
-			DMERR("backup_metadata: dm_io write error");
+	for (blk = find_first_bit(frozen, nr_block); blk < nr_block;
+	     blk = find_next_bit(frozen, nr_block, blk + nr)) {
+		nr = find_next_zero_bit(frozen, nr_block, blk) - blk;
+		nr = min_t(size_t, nr, BACKUP_CHUNK_BLOCKS);
+		data = (char *)buffer + chunk * BACKUP_CHUNK_SIZE;
+		for (i = 0; i < nr; i++) {
+			r = array->read_frozen(array, blk + i, data);
+			if (r)
+				err = r;
+			sc->encrypt(sc, data, METADATA_BLOCK_SIZE, array->key,
+				    NULL, src + blk + i, data);
+			data += METADATA_BLOCK_SIZE;
+		}
+
+		if (writing) {
+			wait_for_completion_io(&ctx.done);
+			if (ctx.error)
+				err = ctx.error;
+		}
+		init_completion(&ctx.done);
+		req.sector = (dst + blk) * SECTORS_PER_BLOCK;
+		req.count = nr * SECTORS_PER_BLOCK;
+		req.mem.addr = (char *)buffer + chunk * BACKUP_CHUNK_SIZE;
+		ie->submit(ie, &req);
+		writing = true;
+		chunk ^= 1;
+		disk_counter.checkpoint_blocks += nr;
+	}
+	if (writing) {
+		wait_for_completion_io(&ctx.done);
+		if (ctx.error)
+			err = ctx.error;
+	}
+
+	if (err) {
+		DMERR("backup_frozen_blocks: error %d", err);
+		for_each_set_bit(blk, frozen, nr_block)
+			set_bit(blk, array->dirty);
 	}
+	return err;
+}
+
+// write back the index and the live copy of the checkpoint region
+static void jindisk_flush_metadata(struct dm_jindisk *jindisk)
+{
+	loff_t start, end;
+	struct file *fp;
+
+	// flush index region
+	fp = jindisk->lsm_tree->file;
+	start = jindisk->meta->superblock->index_region_start *
+		METADATA_BLOCK_SIZE;
+	end = jindisk->meta->superblock->journal_region_start *
+	      METADATA_BLOCK_SIZE;
+	vfs_fsync_range(fp, start, end, 0);
+	// flush checkpoint region
+	dm_bufio_write_dirty_buffers(jindisk->meta->bc);
 }
 
+/*
+ * Take a checkpoint without holding writers back: the valid_fields_lock is
+ * only held to freeze the changed metadata blocks, which are then copied in
+ * the background while writes go on. Journal records added after the freeze
+ * are kept for replay on top of the checkpoint.
+ */
 void add_checkpoint_pack_record(struct metadata *meta)
 {
-	int blk_count, i;
-	uint64_t record_index;
+	int i, r, err = 0, blk_count;
+	uint64_t record_index, record_end;
 	void *buffer = NULL;
-	dm_block_t base, src, dst;
-	struct dm_io_client *client = NULL;
+	unsigned long *frozen[NR_CHECKPOINT_FIELDS] = { NULL };
+	struct disk_array *array[NR_CHECKPOINT_FIELDS];
+	dm_block_t base, src[NR_CHECKPOINT_FIELDS], dst[NR_CHECKPOINT_FIELDS];
 	struct journal_region *journal = meta->journal;
 	struct journal_record j_record;
 
-	buffer = kmalloc(METADATA_BLOCK_SIZE, GFP_KERNEL);
-	if (!buffer) {
-		DMERR("add_checkpoint_pack_record: kmalloc failed");
-		return;
-	}
-	client = dm_io_client_create();
-	if (!client) {
-		DMERR("add_checkpoint_pack_record: dm_io_client_create failed");
-		kfree(buffer);
-		return;
-	}
-
-	down_write(&journal->valid_fields_lock);
-	// backup metadata: SVT/DST/RIT/BITC
+	buffer = vmalloc(2 * BACKUP_CHUNK_SIZE);
+	if (!buffer)
+		goto nomem;
 	for (i = 0; i < NR_CHECKPOINT_FIELDS; i++) {
-		switch (i) {
-		case DATA_SVT:
-			base = meta->superblock->seg_validity_table_start;
-			blk_count = meta->seg_validator->blk_count;
-			break;
-		case DATA_DST:
-			base = meta->superblock->data_seg_table_start;
-			blk_count = meta->dst->blk_count;
-			break;
-		case DATA_RIT:
-			base = meta->superblock->reverse_index_table_start;
-			blk_count = meta->rit->blk_count;
-			break;
-		case INDEX_SVT:
-			base = meta->superblock
-				       ->block_index_table_catalogue_start;
-			blk_count = meta->bit_catalogue->bit_validity_table
-					    ->blk_count;
-			break;
-		case INDEX_BITC:
-			base = meta->superblock
-				       ->block_index_table_catalogue_start +
-			       meta->bit_catalogue->bit_validity_table
-					       ->blk_count *
-				       NR_CHECKPOINT_PACKS;
-			blk_count = meta->bit_catalogue->blk_count;
-			break;
-		default:
-			break;
-		}
+		array[i] = checkpoint_field(meta, i, &base, &blk_count);
+		frozen[i] = bitmap_alloc(array[i]->nr_block, GFP_KERNEL);
+		if (!frozen[i])
+			goto nomem;
 		if (test_bit(i, journal->valid_fields)) {
-			dst = base;
-			src = dst + blk_count;
+			dst[i] = base;
+			src[i] = dst[i] + blk_count;
 		} else {
-			src = base;
-			dst = src + blk_count;
+			src[i] = base;
+			dst[i] = src[i] + blk_count;
 		}
-		backup_metadata(jindisk->raw_dev->bdev, dst, src, blk_count,
-				buffer, client);
 	}
+
+	/*
+	 * Blocks overwritten before the checkpoint are invalidated in it. Those
+	 * logged after the drain stay valid in it, which the gc finds out.
+	 */
+	jindisk->seg_allocator->drain(jindisk->seg_allocator);
+	down_write(&journal->valid_fields_lock);
+	for (i = 0; i < NR_CHECKPOINT_FIELDS; i++)
+		array[i]->freeze(array[i], frozen[i]);
+	record_end = journal->record_end;
 	up_write(&journal->valid_fields_lock);
+
+	// backup metadata: SVT/DST/RIT/BITC
+	for (i = 0; i < NR_CHECKPOINT_FIELDS; i++) {
+		r = backup_frozen_blocks(array[i], dst[i], src[i], frozen[i],
+					 buffer);
+		if (r)
+			err = r;
+	}
+	jindisk_flush_metadata(jindisk);
+	if (err)
+		goto out;
+
 	// add journal_record
+	down_write(&journal->valid_fields_lock);
 	j_record.type = CHECKPOINT_PACK;
 	j_record.checkpoint_pack.record_start = journal->record_start;
-	j_record.checkpoint_pack.record_end = journal->record_end;
+	j_record.checkpoint_pack.record_end = record_end;
 	bitmap_complement(j_record.checkpoint_pack.valid_fields,
 			  journal->valid_fields, NR_CHECKPOINT_FIELDS);
 	j_record.checkpoint_pack.timestamp = ktime_get_real_ns();
 	record_index = journal->jops->add_record(journal, &j_record);
 
 	meta->superblock->last_checkpoint_pack = record_index;
-	journal->record_start = record_index;
+	// same as record_index if nothing was logged since the freeze
+	journal->record_start = record_end;
+	up_write(&journal->valid_fields_lock);
+	disk_counter.checkpoints += 1;
+out:
+	for (i = 0; i < NR_CHECKPOINT_FIELDS; i++)
+		bitmap_free(frozen[i]);
+	vfree(buffer);
+	return;
+nomem:
+	DMERR("add_checkpoint_pack_record: no memory");
+	goto out;
+}
 
-	dm_io_client_destroy(client);
-	kfree(buffer);
+// the journal half full or many metadata blocks changed
+static bool checkpoint_due(struct metadata *meta)
+{
+	int i, blk_count;
+	dm_block_t base;
+	size_t dirty = 0;
+	struct disk_array *array;
+	struct journal_region *journal = meta->journal;
+
+	if ((journal->record_end + MAX_RECORDS - journal->record_start) %
+		    MAX_RECORDS >=
+	    MAX_RECORDS / 2)
+		return true;
+	for (i = 0; i < NR_CHECKPOINT_FIELDS; i++) {
+		array = checkpoint_field(meta, i, &base, &blk_count);
+		dirty += bitmap_weight(array->dirty, array->nr_block);
+	}
+	return dirty >= CHECKPOINT_DIRTY_BLOCKS;
 }
 
-void flush_and_commit(struct dm_jindisk *jindisk, struct bio *bio)
+static void jindisk_checkpoint_work(struct work_struct *ws)
 {
-	int i;
-	loff_t start, end;
-	struct file *fp;
+	struct dm_jindisk *jindisk = container_of(
+		to_delayed_work(ws), struct dm_jindisk, checkpoint_work);
+
+	add_checkpoint_pack_record(jindisk->meta);
+	if (checkpoint_interval)
+		queue_delayed_work(jindisk->checkpoint_wq,
+				   &jindisk->checkpoint_work,
+				   checkpoint_interval * HZ);
+}
+
+/*
+ * Make everything written so far durable. The index and metadata are written
+ * back even with the journal, whose data log records are not replayed yet.
+ * Returns the error of any segment write that failed since the table was
+ * loaded, the data it held is lost.
+ */
+int flush_and_commit(struct dm_jindisk *jindisk)
+{
+	int i, cur;
+	struct default_segment_buffer *segbuf;
 	struct journal_region *journal;
 	struct journal_record j_record;
 
 	DMDEBUG("flush_and_commit...");
-	// flush data segment_buffer
-	for (i = 0; i < POOL_SIZE; i++)
-		jindisk->seg_buffer->flush_bios(jindisk->seg_buffer, i);
-	// flush index region
-	fp = jindisk->lsm_tree->file;
-	start = jindisk->meta->superblock->index_region_start *
-		METADATA_BLOCK_SIZE;
-	end = jindisk->meta->superblock->journal_region_start *
-	      METADATA_BLOCK_SIZE;
-	vfs_fsync_range(fp, start, end, 0);
-	// flush checkpoint region
-	dm_bufio_write_dirty_buffers(jindisk->meta->bc);
+	// flush data segment_buffer, from the oldest buffer to the current one
+	segbuf = jindisk->seg_buffer->implementer(jindisk->seg_buffer);
+	cur = READ_ONCE(segbuf->cur_buffer);
+	for (i = 1; i <= segbuf->nr_buffers; i++)
+		jindisk->seg_buffer->flush_bios(jindisk->seg_buffer,
+						(cur + i) % segbuf->nr_buffers);
+	jindisk->seg_allocator->drain(jindisk->seg_allocator);
+	jindisk_flush_metadata(jindisk);
 
 	// add data_commit record
 	journal = jindisk->meta->journal;
 	j_record.type = DATA_COMMIT;
 	j_record.data_commit.timestamp = ktime_get_real_ns();
 	journal->jops->add_record(journal, &j_record);
-	// add checkpoint_pack record
-	add_checkpoint_pack_record(jindisk->meta);
 	// flush journal_region
 	journal->jops->synchronize(journal);
+
+	if (checkpoint_due(jindisk->meta))
+		mod_delayed_work(jindisk->checkpoint_wq,
+				 &jindisk->checkpoint_work, 0);
+	return READ_ONCE(segbuf->write_error);
 }
 
 static void jindisk_map_bio(struct dm_target *ti, struct bio *bio)
@@ -557,23 +865,80 @@ static int dm_jindisk_target_map(struct dm_target *target, struct bio *bio)
 
 	jindisk_map_bio(target, bio);
 
+	// with num_flush_bios set, preflushes always come without data
+	if (bio->bi_opf & REQ_PREFLUSH || bio_op(bio) == REQ_OP_FLUSH) {
+		jindisk_queue_commit(jindisk, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
 	if (unlikely(bio->bi_iter.bi_size > (MAX_NR_FETCH * DATA_BLOCK_SIZE)))
 		dm_accept_partial_bio(bio, (MAX_NR_FETCH * SECTORS_PER_BLOCK));
 
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
 	case REQ_OP_WRITE:
+	case REQ_OP_DISCARD:
 		defer_bio(jindisk, bio);
 		break;
-	case REQ_OP_FLUSH:
-		flush_and_commit(jindisk, bio);
-		fallthrough;
 	default:
 		return DM_MAPIO_REMAPPED;
 	}
 	return DM_MAPIO_SUBMITTED;
 }
 
+static int jindisk_queues_init(struct dm_jindisk *jindisk)
+{
+	int cpu;
+	struct jindisk_queue *queue;
+
+	jindisk->queue_wq =
+		alloc_workqueue("jindisk-queue", WQ_MEM_RECLAIM | WQ_HIGHPRI, 1);
+	if (!jindisk->queue_wq) {
+		DMERR("alloc_workqueue jindisk-queue failed");
+		return -ENOMEM;
+	}
+	jindisk->read_wq = alloc_workqueue("jindisk-read", WQ_MEM_RECLAIM,
+					   NR_READER_PER_CPU);
+	if (!jindisk->read_wq) {
+		DMERR("alloc_workqueue jindisk-read failed");
+		return -ENOMEM;
+	}
+	jindisk->queues = alloc_percpu(struct jindisk_queue);
+	if (!jindisk->queues) {
+		DMERR("alloc_percpu jindisk_queue failed");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu_ptr(jindisk->queues, cpu);
+		spin_lock_init(&queue->lock);
+		bio_list_init(&queue->reads);
+		bio_list_init(&queue->writes);
+		queue->nr_reads = 0;
+		queue->nr_writes = 0;
+		INIT_WORK(&queue->work, process_queued_bios);
+	}
+
+	// one commit at a time, each covering everything queued before it
+	jindisk->commit_wq = alloc_ordered_workqueue("jindisk-commit",
+						     WQ_MEM_RECLAIM);
+	if (!jindisk->commit_wq) {
+		DMERR("alloc_workqueue jindisk-commit failed");
+		return -ENOMEM;
+	}
+	INIT_WORK(&jindisk->commit_work, jindisk_commit_work);
+	spin_lock_init(&jindisk->commit_lock);
+	bio_list_init(&jindisk->commit_bios);
+
+	jindisk->checkpoint_wq = alloc_ordered_workqueue("jindisk-checkpoint",
+							 WQ_MEM_RECLAIM);
+	if (!jindisk->checkpoint_wq) {
+		DMERR("alloc_workqueue jindisk-checkpoint failed");
+		return -ENOMEM;
+	}
+	INIT_DELAYED_WORK(&jindisk->checkpoint_work, jindisk_checkpoint_work);
+	return 0;
+}
+
 sector_t dm_devsize(struct dm_dev *dev)
 {
 	return i_size_read(dev->bdev->bd_inode) >> SECTOR_SHIFT;
@@ -581,6 +946,21 @@ sector_t dm_devsize(struct dm_dev *dev)
 
 void dm_jindisk_destroy(struct dm_target *ti, struct dm_jindisk *sd)
 {
+	if (sd->queue_wq)
+		destroy_workqueue(sd->queue_wq);
+	if (sd->read_wq)
+		destroy_workqueue(sd->read_wq);
+	// readahead work searches the index and fills the data cache
+	if (sd->readahead)
+		sd->readahead->destroy(sd->readahead);
+	if (sd->commit_wq)
+		destroy_workqueue(sd->commit_wq);
+	if (sd->checkpoint_wq) {
+		cancel_delayed_work_sync(&sd->checkpoint_work);
+		destroy_workqueue(sd->checkpoint_wq);
+	}
+	if (sd->queues)
+		free_percpu(sd->queues);
 	if (sd->seg_buffer)
 		sd->seg_buffer->destroy(sd->seg_buffer);
 	if (sd->seg_allocator)
@@ -591,8 +971,14 @@ void dm_jindisk_destroy(struct dm_target *ti, struct dm_jindisk *sd)
 		sd->meta->destroy(sd->meta);
 	if (sd->cipher)
 		sd->cipher->destroy(sd->cipher);
-	if (sd->io_client)
-		dm_io_client_destroy(sd->io_client);
+	if (sd->data_cache)
+		sd->data_cache->destroy(sd->data_cache);
+	if (sd->io_engine)
+		sd->io_engine->destroy(sd->io_engine);
+	mempool_destroy(sd->page_pool);
+	mempool_destroy(sd->read_pool);
+	mempool_destroy(sd->diskio_ctx_pool);
+	kmem_cache_destroy(sd->diskio_ctx_cache);
 
 	dm_put_device(ti, sd->raw_dev);
 	if (sd)
@@ -661,14 +1047,27 @@ static int dm_jindisk_target_ctr(struct dm_target *target, unsigned int argc,
 		goto bad;
 	}
 
-	sema_init(&jindisk->max_reader, MAX_READER);
-	jindisk->io_client = dm_io_client_create();
-	if (!jindisk->io_client) {
-		target->error = "could not create dm-io client for jindisk";
+	jindisk->io_engine = bio_io_engine_create();
+	if (!jindisk->io_engine) {
+		target->error = "could not create io engine for jindisk";
 		ret = -EAGAIN;
 		goto bad;
 	}
 
+	jindisk->diskio_ctx_cache = KMEM_CACHE(diskio_ctx, 0);
+	if (jindisk->diskio_ctx_cache)
+		jindisk->diskio_ctx_pool = mempool_create_slab_pool(
+			JINDISK_MIN_IOS, jindisk->diskio_ctx_cache);
+	jindisk->page_pool = mempool_create_page_pool(JINDISK_MIN_IOS, 0);
+	jindisk->read_pool = mempool_create_kmalloc_pool(
+		JINDISK_MIN_READS, sizeof(struct jindisk_read));
+	if (!jindisk->diskio_ctx_pool || !jindisk->page_pool ||
+	    !jindisk->read_pool) {
+		target->error = "could not create jindisk mempools";
+		ret = -ENOMEM;
+		goto bad;
+	}
+
 	jindisk->cipher = aes_gcm_cipher_create();
 	if (!jindisk->cipher) {
 		target->error = "could not create jindisk cipher";
@@ -676,6 +1075,12 @@ static int dm_jindisk_target_ctr(struct dm_target *target, unsigned int argc,
 		goto bad;
 	}
 
+	jindisk->data_cache =
+		twoq_cache_create(data_cache_blocks, DATA_BLOCK_SIZE);
+	/* prefetched blocks are parked in the data cache */
+	if (jindisk->data_cache && enable_readahead)
+		jindisk->readahead = readahead_create();
+
 	jindisk->meta = metadata_create(root_key, root_iv, action_flag,
 					jindisk->raw_dev->bdev);
 	if (!jindisk->meta) {
@@ -701,16 +1106,28 @@ static int dm_jindisk_target_ctr(struct dm_target *target, unsigned int argc,
 		goto bad;
 	}
 
-	spin_lock_init(&jindisk->req_lock);
-	bio_list_init(&jindisk->deferred_bios);
-	jindisk->seg_buffer = segbuf_create();
+	jindisk->seg_buffer = segbuf_create(segment_buffers);
 	if (!jindisk->seg_buffer) {
 		target->error = "could not create jindisk segment buffer";
 		ret = -EAGAIN;
 		goto bad;
 	}
 
-	INIT_WORK(&jindisk->deferred_bio_worker, process_deferred_bios);
+	ret = jindisk_queues_init(jindisk);
+	if (ret) {
+		target->error = "could not create jindisk bio queues";
+		goto bad;
+	}
+	if (checkpoint_interval)
+		queue_delayed_work(jindisk->checkpoint_wq,
+				   &jindisk->checkpoint_work,
+				   checkpoint_interval * HZ);
+
+	target->per_io_data_size = sizeof(struct jindisk_io);
+	target->num_flush_bios = 1;
+	// discards unmap blocks, the raw device never sees them
+	target->num_discard_bios = 1;
+	target->discards_supported = true;
 	target->private = jindisk;
 	return 0;
 bad:
@@ -730,6 +1147,14 @@ static void dm_jindisk_target_dtr(struct dm_target *ti)
 	dm_jindisk_destroy(ti, sd);
 }
 
+static void dm_jindisk_target_io_hints(struct dm_target *target,
+				       struct queue_limits *limits)
+{
+	// only whole blocks can be unmapped
+	limits->discard_granularity = DATA_BLOCK_SIZE;
+	limits->max_discard_sectors = MAX_NR_FETCH * SECTORS_PER_BLOCK;
+}
+
 /*  This structure is fops for dm_jindisk target */
 static struct target_type dm_jindisk = {
 	.name = "jindisk",
@@ -738,33 +1163,89 @@ static struct target_type dm_jindisk = {
 	.ctr = dm_jindisk_target_ctr,
 	.dtr = dm_jindisk_target_dtr,
 	.map = dm_jindisk_target_map,
+	.io_hints = dm_jindisk_target_io_hints,
 };
 
 /*---- sysfs interface ----*/
 
+static void jindisk_queue_depth(unsigned int *nr_reads,
+				unsigned int *nr_writes)
+{
+	int cpu;
+	struct jindisk_queue *queue;
+
+	*nr_reads = *nr_writes = 0;
+	if (!jindisk || !jindisk->queues)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		queue = per_cpu_ptr(jindisk->queues, cpu);
+		*nr_reads += READ_ONCE(queue->nr_reads);
+		*nr_writes += READ_ONCE(queue->nr_writes);
+	}
+}
+
 static ssize_t disk_stats_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
 	int size = 0;
+	unsigned int nr_reads, nr_writes;
 
+	jindisk_queue_depth(&nr_reads, &nr_writes);
 	size += sysfs_emit_at(buf, size, "read_req_blocks:%llu\n",
 			      disk_counter.read_req_blocks);
 	size += sysfs_emit_at(buf, size, "read_io_blocks:%llu\n",
 			      disk_counter.read_io_blocks);
-	size += sysfs_emit_at(buf, size, "read_io_count:%llu\n\n",
+	size += sysfs_emit_at(buf, size, "read_io_count:%llu\n",
 			      disk_counter.read_io_count);
+	size += sysfs_emit_at(buf, size, "read_queue_depth:%u\n", nr_reads);
+	size += sysfs_emit_at(buf, size, "read_queued_bios:%llu\n",
+			      disk_counter.read_queued_bios);
+	size += sysfs_emit_at(buf, size, "read_queue_wait_ns:%llu\n\n",
+			      disk_counter.read_queue_wait_ns);
 
 	size += sysfs_emit_at(buf, size, "write_req_blocks:%llu\n",
 			      disk_counter.write_req_blocks);
 	size += sysfs_emit_at(buf, size, "write_io_blocks:%llu\n",
 			      disk_counter.write_io_blocks);
-	size += sysfs_emit_at(buf, size, "write_io_count:%llu\n\n",
+	size += sysfs_emit_at(buf, size, "write_io_count:%llu\n",
 			      disk_counter.write_io_count);
+	size += sysfs_emit_at(buf, size, "direct_write_blocks:%llu\n",
+			      disk_counter.direct_write_blocks);
+	size += sysfs_emit_at(buf, size, "partial_log_blocks:%llu\n",
+			      disk_counter.partial_log_blocks);
+	size += sysfs_emit_at(buf, size, "discard_blocks:%llu\n",
+			      disk_counter.discard_blocks);
+	size += sysfs_emit_at(buf, size, "stale_blocks:%llu\n",
+			      disk_counter.stale_blocks);
+	size += sysfs_emit_at(buf, size, "write_queue_depth:%u\n", nr_writes);
+	size += sysfs_emit_at(buf, size, "write_queued_bios:%llu\n",
+			      disk_counter.write_queued_bios);
+	size += sysfs_emit_at(buf, size, "write_queue_wait_ns:%llu\n",
+			      disk_counter.write_queue_wait_ns);
+	size += sysfs_emit_at(buf, size, "write_stalls:%llu\n",
+			      disk_counter.write_stalls);
+	size += sysfs_emit_at(buf, size, "write_stall_ns:%llu\n",
+			      disk_counter.write_stall_ns);
+	size += sysfs_emit_at(buf, size, "commits:%llu\n",
+			      disk_counter.commits);
+	size += sysfs_emit_at(buf, size, "commit_bios:%llu\n",
+			      disk_counter.commit_bios);
+	size += sysfs_emit_at(buf, size, "checkpoints:%llu\n",
+			      disk_counter.checkpoints);
+	size += sysfs_emit_at(buf, size, "checkpoint_blocks:%llu\n\n",
+			      disk_counter.checkpoint_blocks);
 
 	size += sysfs_emit_at(buf, size, "minor_compaction:%llu\n",
 			      disk_counter.minor_compaction);
-	size += sysfs_emit_at(buf, size, "major_compaction:%llu\n\n",
+	size += sysfs_emit_at(buf, size, "major_compaction:%llu\n",
 			      disk_counter.major_compaction);
+	size += sysfs_emit_at(buf, size, "memtable_slowdowns:%llu\n",
+			      disk_counter.memtable_slowdowns);
+	size += sysfs_emit_at(buf, size, "memtable_stops:%llu\n",
+			      disk_counter.memtable_stops);
+	size += sysfs_emit_at(buf, size, "memtable_stop_ns:%llu\n\n",
+			      disk_counter.memtable_stop_ns);
 	size += sysfs_emit_at(buf, size, "bit_created:%llu\n",
 			      disk_counter.bit_created);
 	size += sysfs_emit_at(buf, size, "bit_removed:%llu\n",
@@ -773,6 +1254,12 @@ static ssize_t disk_stats_show(struct kobject *kobj,
 			      disk_counter.bit_node_cache_hit);
 	size += sysfs_emit_at(buf, size, "bit_node_cache_miss:%llu\n",
 			      disk_counter.bit_node_cache_miss);
+	size += sysfs_emit_at(buf, size, "data_cache_hit:%llu\n",
+			      disk_counter.data_cache_hit);
+	size += sysfs_emit_at(buf, size, "data_cache_miss:%llu\n",
+			      disk_counter.data_cache_miss);
+	size += sysfs_emit_at(buf, size, "readahead_blocks:%llu\n",
+			      disk_counter.readahead_blocks);
 
 	return size;
 }
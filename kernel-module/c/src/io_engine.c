@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2022 Ant Group CO., Ltd. All rights reserved.
+ *
+ * This file is released under the GPLv2.
+ */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "../include/dm_jindisk.h"
+#include "../include/io_engine.h"
+
+struct io_job {
+	struct bio_io_engine *engine;
+	atomic_t remaining;
+	int error;
+	io_engine_notify_fn notify;
+	void *context;
+	// set for synchronous requests, the submitter frees the job
+	struct completion *wait;
+};
+
+static void io_job_put(struct io_job *job)
+{
+	struct bio_io_engine *this = job->engine;
+
+	if (!atomic_dec_and_test(&job->remaining))
+		return;
+
+	if (job->wait) {
+		complete(job->wait);
+		return;
+	}
+	job->notify(job->error, job->context);
+	mempool_free(job, this->job_pool);
+}
+
+static void io_engine_endio(struct bio *bio)
+{
+	struct io_job *job = bio->bi_private;
+	struct bio_io_engine *this = job->engine;
+	unsigned long flags;
+
+	if (bio->bi_status)
+		job->error = blk_status_to_errno(bio->bi_status);
+	bio_put(bio);
+	io_job_put(job);
+
+	// destroy takes the lock too, the engine outlives the wakeup
+	spin_lock_irqsave(&this->wait.lock, flags);
+	atomic_dec(&this->inflight);
+	wake_up_locked(&this->wait);
+	spin_unlock_irqrestore(&this->wait.lock, flags);
+}
+
+static struct bio *io_engine_alloc_bio(struct bio_io_engine *this,
+				       struct io_request *req,
+				       struct io_job *job, sector_t sector,
+				       size_t bytes)
+{
+	struct bio *bio;
+	unsigned int nr_vecs;
+
+	nr_vecs = min_t(size_t, BIO_MAX_VECS,
+			DIV_ROUND_UP(bytes, PAGE_SIZE) + 1);
+	bio = bio_alloc_bioset(GFP_NOIO, nr_vecs, &this->bs);
+	bio_set_dev(bio, req->bdev);
+	bio->bi_opf = req->bi_op;
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_end_io = io_engine_endio;
+	bio->bi_private = job;
+	atomic_inc(&job->remaining);
+	return bio;
+}
+
+static void io_engine_submit_bio(struct bio_io_engine *this, struct bio *bio)
+{
+	wait_event(this->wait, atomic_add_unless(&this->inflight, 1,
+						 IO_ENGINE_MAX_INFLIGHT));
+	submit_bio(bio);
+}
+
+/*
+ * Locate the page holding byte @done of the request memory. Buffers may
+ * start anywhere in a page, page lists are walked one page at a time.
+ */
+static struct page *io_request_page(struct io_request *req,
+				    struct page_list **pl, size_t done,
+				    unsigned int *offset)
+{
+	char *addr;
+
+	switch (req->mem_type) {
+	case DM_IO_KMEM:
+		addr = (char *)req->mem.addr + done;
+		*offset = offset_in_page(addr);
+		return virt_to_page(addr);
+	case DM_IO_VMA:
+		addr = (char *)req->mem.addr + done;
+		*offset = offset_in_page(addr);
+		return vmalloc_to_page(addr);
+	case DM_IO_PAGE_LIST:
+		*offset = 0;
+		return *pl ? (*pl)->page : NULL;
+	default:
+		return NULL;
+	}
+}
+
+int bio_io_engine_submit(struct io_engine *ie, struct io_request *req)
+{
+	struct bio_io_engine *this =
+		container_of(ie, struct bio_io_engine, io_engine);
+	DECLARE_COMPLETION_ONSTACK(wait);
+	struct page_list *pl = req->mem.pl;
+	size_t done = 0, total = to_bytes(req->count);
+	sector_t sector = req->sector;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	struct io_job *job;
+	int err = 0;
+
+	job = mempool_alloc(this->job_pool, GFP_NOIO);
+	job->engine = this;
+	atomic_set(&job->remaining, 1);
+	job->error = 0;
+	job->notify = req->notify;
+	job->context = req->context;
+	job->wait = req->notify ? NULL : &wait;
+
+	blk_start_plug(&plug);
+	// an empty request, e.g. a flush, still goes down as one bio
+	if (!total)
+		bio = io_engine_alloc_bio(this, req, job, sector, 0);
+	while (done < total) {
+		struct page *page;
+		unsigned int offset, len;
+
+		page = io_request_page(req, &pl, done, &offset);
+		if (!page) {
+			DMERR("io_engine bad request memory type:%d",
+			      req->mem_type);
+			job->error = -EINVAL;
+			break;
+		}
+		len = min_t(size_t, PAGE_SIZE - offset, total - done);
+		if (!bio)
+			bio = io_engine_alloc_bio(this, req, job, sector,
+						  total - done);
+		if (bio_add_page(bio, page, len, offset) != len) {
+			io_engine_submit_bio(this, bio);
+			bio = NULL;
+			continue;
+		}
+		done += len;
+		sector += len >> SECTOR_SHIFT;
+		if (req->mem_type == DM_IO_PAGE_LIST)
+			pl = pl->next;
+	}
+	if (bio)
+		io_engine_submit_bio(this, bio);
+	blk_finish_plug(&plug);
+
+	io_job_put(job);
+	if (req->notify)
+		return 0;
+
+	wait_for_completion_io(&wait);
+	err = job->error;
+	mempool_free(job, this->job_pool);
+	return err;
+}
+
+void bio_io_engine_destroy(struct io_engine *ie)
+{
+	struct bio_io_engine *this =
+		container_of(ie, struct bio_io_engine, io_engine);
+
+	wait_event(this->wait, !atomic_read(&this->inflight));
+	// the last completion may still be waking us up
+	spin_lock_irq(&this->wait.lock);
+	spin_unlock_irq(&this->wait.lock);
+	mempool_destroy(this->job_pool);
+	bioset_exit(&this->bs);
+	kfree(this);
+}
+
+int bio_io_engine_init(struct bio_io_engine *this)
+{
+	int err;
+
+	err = bioset_init(&this->bs, IO_ENGINE_MIN_JOBS, 0, BIOSET_NEED_BVECS);
+	if (err) {
+		DMERR("bio_io_engine bioset_init failed");
+		return err;
+	}
+	this->job_pool = mempool_create_kmalloc_pool(IO_ENGINE_MIN_JOBS,
+						     sizeof(struct io_job));
+	if (!this->job_pool) {
+		DMERR("bio_io_engine mempool_create failed");
+		bioset_exit(&this->bs);
+		return -ENOMEM;
+	}
+	atomic_set(&this->inflight, 0);
+	init_waitqueue_head(&this->wait);
+
+	this->io_engine.submit = bio_io_engine_submit;
+	this->io_engine.destroy = bio_io_engine_destroy;
+	return 0;
+}
+
+struct io_engine *bio_io_engine_create(void)
+{
+	int r;
+	struct bio_io_engine *this;
+
+	this = kzalloc(sizeof(struct bio_io_engine), GFP_KERNEL);
+	if (!this)
+		return NULL;
+
+	r = bio_io_engine_init(this);
+	if (r) {
+		kfree(this);
+		return NULL;
+	}
+
+	return &this->io_engine;
+}
@@ -14,7 +14,7 @@ struct journal_ctx {
 	atomic64_t *cnt;
 };
 
-void journal_iocb(unsigned long error, void *ctx)
+void journal_iocb(int error, void *ctx)
 {
 	struct journal_ctx *jctx = ctx;
 
@@ -29,24 +29,21 @@ void journal_iocb(unsigned long error, void *ctx)
 	kfree(jctx);
 }
 
-void journal_region_io(struct dm_io_client *client, dm_block_t blk_pba,
-		       int count, void *buffer, struct journal_ctx *ctx)
+void journal_region_io(dm_block_t blk_pba, int count, void *buffer,
+		       struct journal_ctx *ctx)
 {
-	struct dm_io_request req = {
+	struct io_request req = {
 		.bi_op = ctx->bi_op,
-		.mem.type = DM_IO_KMEM,
-		.mem.ptr.addr = buffer,
-		.notify.fn = journal_iocb,
-		.notify.context = ctx,
-		.client = client,
-	};
-	struct dm_io_region region = {
 		.bdev = jindisk->raw_dev->bdev,
 		.sector = blk_pba * SECTORS_PER_BLOCK,
 		.count = count * SECTORS_PER_BLOCK,
+		.mem_type = DM_IO_KMEM,
+		.mem.addr = buffer,
+		.notify = journal_iocb,
+		.context = ctx,
 	};
 
-	dm_io(&req, 1, &region, 0);
+	jindisk->io_engine->submit(jindisk->io_engine, &req);
 }
 
 struct journal_block *journal_get_block(struct journal_region *this,
@@ -179,7 +176,7 @@ void journal_buffer_load(struct journal_region *this, uint64_t record_start,
 	struct journal_block *buffer;
 	struct completion wait;
 	atomic64_t read_cnt;
-	struct dm_io_client *client;
+	struct blk_plug plug;
 
 	segno = record_start / RECORDS_PER_SEGMENT;
 	if (segno >= NR_JOURNAL_SEGMENT) {
@@ -203,10 +200,10 @@ void journal_buffer_load(struct journal_region *this, uint64_t record_start,
 		blk_count = BLOCKS_PER_SEGMENT - offset;
 	}
 
-	client = dm_io_client_create();
 	init_completion(&wait);
 	atomic64_set(&read_cnt, blk_count);
 
+	blk_start_plug(&plug);
 	for (i = 0; i < blk_count; i++) {
 		blk_pba =
 			this->superblock->journal_region_start + blk_start + i;
@@ -224,13 +221,13 @@ void journal_buffer_load(struct journal_region *this, uint64_t record_start,
 		ctx->wait = &wait;
 		ctx->cnt = &read_cnt;
 
-		journal_region_io(client, blk_pba, 1, buffer, ctx);
+		journal_region_io(blk_pba, 1, buffer, ctx);
 	}
+	blk_finish_plug(&plug);
 
 	if (!atomic64_sub_and_test(blk_count - i, &read_cnt))
 		wait_for_completion_io(&wait);
 
-	dm_io_client_destroy(client);
 	if (i != blk_count) {
 		DMERR("journal_buffer_load not completed");
 		return;
@@ -287,7 +284,7 @@ void journal_synchronize(struct journal_region *this)
 	struct journal_block *buffer;
 	struct completion wait;
 	atomic64_t write_cnt;
-	struct dm_io_client *client;
+	struct blk_plug plug;
 
 	if (this->last_sync_record == this->record_end)
 		return;
@@ -301,11 +298,11 @@ void journal_synchronize(struct journal_region *this)
 			BLOCKS_PER_SEGMENT - (blk_start % BLOCKS_PER_SEGMENT);
 	}
 
-	client = dm_io_client_create();
 	init_completion(&wait);
 	atomic64_set(&write_cnt, blk_count);
 	mutex_lock(&this->sync_lock);
 
+	blk_start_plug(&plug);
 	for (i = 0; i < blk_count; i++) {
 		blk_pba =
 			this->superblock->journal_region_start + blk_start + i;
@@ -330,8 +327,9 @@ void journal_synchronize(struct journal_region *this)
 		ctx->wait = &wait;
 		ctx->cnt = &write_cnt;
 
-		journal_region_io(client, blk_pba, 1, buffer, ctx);
+		journal_region_io(blk_pba, 1, buffer, ctx);
 	}
+	blk_finish_plug(&plug);
 	if (!atomic64_sub_and_test(blk_count - i, &write_cnt))
 		wait_for_completion_io(&wait);
 
@@ -342,7 +340,6 @@ void journal_synchronize(struct journal_region *this)
 		this->last_sync_record = this->record_end;
 	}
 	mutex_unlock(&this->sync_lock);
-	dm_io_client_destroy(client);
 
 	if (this->last_sync_record == this->record_end) {
 		this->superblock->record_start = this->record_start;
@@ -460,13 +457,17 @@ int journal_region_init(struct journal_region *this,
 {
 #if ENABLE_JOURNAL
 	struct journal_record j_record;
+#endif
+
+	// writers and checkpoints use it with or without the journal
+	init_rwsem(&this->valid_fields_lock);
+#if ENABLE_JOURNAL
 	this->status = JOURNAL_UNINITIALIZED;
 	this->superblock = superblock;
 	this->jops = &default_jops;
 	this->record_start = superblock->record_start;
 	this->record_end = superblock->record_end;
 	mutex_init(&this->sync_lock);
-	init_rwsem(&this->valid_fields_lock);
 	this->cipher = aes_gcm_cipher_create();
 	if (!this->cipher) {
 		DMERR("journal_region could not create cipher");
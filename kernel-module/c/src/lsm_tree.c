@@ -5,6 +5,7 @@
  */
 
 #include <linux/bsearch.h>
+#include <linux/delay.h>
 #include <linux/mempool.h>
 #include <linux/random.h>
 #include <linux/slab.h>
@@ -13,6 +14,7 @@
 #include "../include/lsm_tree.h"
 #include "../include/memtable.h"
 #include "../include/metadata.h"
+#include "../include/segment_allocator.h"
 #include "../include/segment_buffer.h"
 
 struct compaction_work {
@@ -20,6 +22,7 @@ struct compaction_work {
 	void *data;
 };
 static struct workqueue_struct *compaction_wq;
+static mempool_t *compaction_work_pool;
 
 static struct aead_cipher *global_cipher; // global cipher
 
@@ -675,7 +678,7 @@ out:
 }
 
 void bit_file_range_search(struct lsm_file *lsm_file, uint32_t start,
-			   uint32_t end, struct memtable *results,
+			   uint32_t end, struct record *records,
 			   unsigned long *found)
 {
 	int err = 0, i;
@@ -709,8 +712,7 @@ void bit_file_range_search(struct lsm_file *lsm_file, uint32_t start,
 
 		record = bit_file_search_cached_leaf(this, key);
 		if (record) {
-			results->put(results, key, record_copy(record),
-				     record_destroy);
+			records[key - start] = *record;
 			set_bit(key - start, found);
 			continue;
 		}
@@ -727,9 +729,7 @@ void bit_file_range_search(struct lsm_file *lsm_file, uint32_t start,
 				       cached_leaf_destroy);
 		for (i = 0; i < leaf->nr_record; ++i) {
 			if (leaf->keys[i] == key) {
-				results->put(results, key,
-					     record_copy(&leaf->records[i]),
-					     record_destroy);
+				records[key - start] = leaf->records[i];
 				set_bit(key - start, found);
 			}
 		}
@@ -917,6 +917,8 @@ int bit_file_init(struct bit_file *this, struct file *file, loff_t root,
 	this->lsm_file.id = id;
 	this->lsm_file.level = level;
 	this->lsm_file.version = version;
+	refcount_set(&this->lsm_file.refs, 1);
+	this->lsm_file.catalogue = NULL;
 	this->lsm_file.search = bit_file_search;
 	this->lsm_file.iterator = bit_file_iterator;
 	this->lsm_file.get_first_key = bit_file_get_first_key;
@@ -960,6 +962,21 @@ bad:
 	return NULL;
 }
 
+void lsm_file_get(struct lsm_file *file)
+{
+	refcount_inc(&file->refs);
+}
+
+void lsm_file_put(struct lsm_file *file)
+{
+	if (!refcount_dec_and_test(&file->refs))
+		return;
+	// no reader is left, the space of the file can be reused
+	if (file->catalogue)
+		file->catalogue->release_file(file->catalogue, file->id);
+	file->destroy(file);
+}
+
 // block index table level implementaion
 bool bit_level_is_full(struct lsm_level *lsm_level)
 {
@@ -1013,17 +1030,13 @@ int bit_file_cmp_key(const void *p_key, const void *p_file)
 	return 1;
 }
 
-struct bit_file **bit_level_locate_file_pointer(struct bit_level *this,
-						uint32_t key)
+struct bit_file *bit_files_locate(struct bit_file **files, size_t size,
+				   uint32_t key)
 {
-	return bsearch(&key, this->bit_files, this->size,
-		       sizeof(struct bit_file *), bit_file_cmp_key);
-}
-
-struct bit_file *bit_level_locate_file(struct bit_level *this, uint32_t key)
-{
-	struct bit_file **result = bit_level_locate_file_pointer(this, key);
+	struct bit_file **result;
 
+	result = bsearch(&key, files, size, sizeof(struct bit_file *),
+			 bit_file_cmp_key);
 	if (!result)
 		return NULL;
 	return *(struct bit_file **)result;
@@ -1055,64 +1068,67 @@ int bit_level_add_file(struct lsm_level *lsm_level, struct lsm_file *file)
 	return 0;
 }
 
-int bit_level_linear_search(struct bit_level *this, uint32_t key, void *val)
+int bit_files_linear_search(struct bit_file **files, size_t size,
+			    uint32_t key, void *val)
 {
 	int err = 0;
 	bool found = false;
 	size_t i, cur_version = 0;
 
-	for (i = 0; i < this->size; ++i) {
-		if (this->bit_files[i]->lsm_file.version < cur_version)
+	for (i = 0; i < size; ++i) {
+		if (files[i]->lsm_file.version < cur_version)
 			continue;
-		if (key < this->bit_files[i]->first_key ||
-		    key > this->bit_files[i]->last_key)
+		if (key < files[i]->first_key || key > files[i]->last_key)
 			continue;
 
-		err = bit_file_search(&this->bit_files[i]->lsm_file, key, val);
+		err = bit_file_search(&files[i]->lsm_file, key, val);
 		if (!err) {
 			found = true;
-			cur_version = this->bit_files[i]->lsm_file.version;
+			cur_version = files[i]->lsm_file.version;
 		}
 	}
 	return found ? 0 : -ENODATA;
 }
 
+// search the files of a level, sorted by key except in level 0
+int bit_files_search(struct bit_file **files, size_t size, size_t level,
+		     uint32_t key, void *val)
+{
+	struct bit_file *file;
+
+	if (level == 0)
+		return bit_files_linear_search(files, size, key, val);
+
+	file = bit_files_locate(files, size, key);
+	if (!file)
+		return -ENODATA;
+	return bit_file_search(&file->lsm_file, key, val);
+}
+
 int bit_level_search(struct lsm_level *lsm_level, uint32_t key, void *val)
 {
 	int ret;
-	struct bit_file *file;
 	struct bit_level *this =
 		container_of(lsm_level, struct bit_level, lsm_level);
-	down_read(&lsm_level->l_lock);
-	if (lsm_level->level == 0) {
-		ret = bit_level_linear_search(this, key, val);
-		goto out;
-	}
 
-	file = bit_level_locate_file(this, key);
-	if (!file) {
-		ret = -ENODATA;
-		goto out;
-	}
-	ret = bit_file_search(&file->lsm_file, key, val);
-out:
+	down_read(&lsm_level->l_lock);
+	ret = bit_files_search(this->bit_files, this->size, lsm_level->level,
+			       key, val);
 	up_read(&lsm_level->l_lock);
 	return ret;
 }
 
-// return the start of next range_search
-void bit_level_range_search(struct lsm_level *lsm_level, uint32_t start,
-			    uint32_t end, struct memtable *results,
-			    unsigned long *found)
+void bit_files_range_search(struct bit_file **files, size_t size,
+			    size_t level, uint32_t start, uint32_t end,
+			    struct record *records, unsigned long *found)
 {
 	uint32_t key;
 	struct bit_file *file;
-	struct bit_level *this =
-		container_of(lsm_level, struct bit_level, lsm_level);
+
 	// FATAL: not work if there are multiple bit_files in level 0
-	if (lsm_level->level == 0 && this->size > 0) {
-		bit_file_range_search(&this->bit_files[0]->lsm_file, start, end,
-				      results, found);
+	if (level == 0 && size > 0) {
+		bit_file_range_search(&files[0]->lsm_file, start, end, records,
+				      found);
 		return;
 	}
 	// search level 1
@@ -1120,10 +1136,10 @@ void bit_level_range_search(struct lsm_level *lsm_level, uint32_t start,
 		if (test_bit(key - start, found))
 			continue;
 
-		file = bit_level_locate_file(this, key);
+		file = bit_files_locate(files, size, key);
 		if (!file)
 			continue;
-		bit_file_range_search(&file->lsm_file, start, end, results,
+		bit_file_range_search(&file->lsm_file, start, end, records,
 				      found);
 	}
 	return;
@@ -1259,7 +1275,8 @@ void bit_level_destroy(struct lsm_level *lsm_level)
 		container_of(lsm_level, struct bit_level, lsm_level);
 	if (!IS_ERR_OR_NULL(this)) {
 		for (i = 0; i < this->size; ++i)
-			bit_file_destroy(&this->bit_files[i]->lsm_file);
+			lsm_file_put(&this->bit_files[i]->lsm_file);
+		kfree(this->bit_files);
 		kfree(this);
 	}
 }
@@ -1572,15 +1589,16 @@ int compaction_job_run(struct compaction_job *this)
 					file->get_stats(file));
 	this->level2->add_file(this->level2, file);
 
+	// readers of the current version may still search the merged files
 	list_for_each_entry (file, &demoted_files, node) {
 		this->level1->remove_file(this->level1, file->id);
-		this->catalogue->release_file(this->catalogue, file->id);
-		file->destroy(file);
+		file->catalogue = this->catalogue;
+		lsm_file_put(file);
 	}
 	list_for_each_entry (file, &relative_files, node) {
 		this->level2->remove_file(this->level2, file->id);
-		this->catalogue->release_file(this->catalogue, file->id);
-		file->destroy(file);
+		file->catalogue = this->catalogue;
+		lsm_file_put(file);
 	}
 	disk_counter.major_compaction += 1;
 exit:
@@ -1633,6 +1651,137 @@ bad:
 	return NULL;
 }
 
+// lsm version implementation
+static void memtable_put(struct memtable *memtable)
+{
+	if (memtable && refcount_dec_and_test(&memtable->refs))
+		memtable->destroy(memtable);
+}
+
+static void lsm_version_free(struct lsm_version *this)
+{
+	size_t i, j;
+
+	for (i = 0; i < this->nr_level; i++) {
+		for (j = 0; j < this->levels[i].size; j++)
+			lsm_file_put(&this->levels[i].files[j]->lsm_file);
+		kfree(this->levels[i].files);
+	}
+	for (i = 0; i < this->nr_immutable; i++)
+		memtable_put(this->immutables[i]);
+	kfree(this);
+}
+
+static void lsm_version_free_work(struct work_struct *ws)
+{
+	lsm_version_free(
+		container_of(to_rcu_work(ws), struct lsm_version, rwork));
+}
+
+// a reader may still be taking a reference, free after a grace period
+static void lsm_version_put(struct lsm_version *this)
+{
+	if (!refcount_dec_and_test(&this->refs))
+		return;
+	INIT_RCU_WORK(&this->rwork, lsm_version_free_work);
+	queue_rcu_work(compaction_wq, &this->rwork);
+}
+
+static struct lsm_version *lsm_version_get(struct lsm_tree *this)
+{
+	struct lsm_version *version;
+
+	rcu_read_lock();
+	// a version dropped meanwhile has been replaced already
+	do {
+		version = rcu_dereference(this->version);
+	} while (!refcount_inc_not_zero(&version->refs));
+	rcu_read_unlock();
+	return version;
+}
+
+/*
+ * Publish a version of the current immutable memtables and level files. A
+ * version missing records would serve stale lookups, so the allocations
+ * never fail. A memtable leaves the queue only once its file is in level 0.
+ */
+static void lsm_tree_install_version(struct lsm_tree *this)
+{
+	size_t i, j, nr_level = this->catalogue->nr_disk_level;
+	struct lsm_version *version, *old;
+	struct bit_level *level;
+
+	version = kzalloc(struct_size(version, levels, nr_level),
+			  GFP_NOIO | __GFP_NOFAIL);
+	refcount_set(&version->refs, 1);
+	version->nr_level = nr_level;
+
+	mutex_lock(&this->version_lock);
+	mutex_lock(&this->im_lock);
+	version->nr_immutable = this->nr_immutable;
+	for (i = 0; i < this->nr_immutable; i++) {
+		version->immutables[i] =
+			this->immutables[this->nr_immutable - 1 - i];
+		refcount_inc(&version->immutables[i]->refs);
+	}
+	mutex_unlock(&this->im_lock);
+
+	for (i = 0; i < nr_level; i++) {
+		level = container_of(this->levels[i], struct bit_level,
+				     lsm_level);
+		down_read(&level->lsm_level.l_lock);
+		version->levels[i].level = i;
+		version->levels[i].size = level->size;
+		version->levels[i].files =
+			kmemdup(level->bit_files,
+				level->size * sizeof(struct bit_file *),
+				GFP_NOIO | __GFP_NOFAIL);
+		for (j = 0; j < level->size; j++)
+			lsm_file_get(&level->bit_files[j]->lsm_file);
+		up_read(&level->lsm_level.l_lock);
+	}
+
+	old = rcu_dereference_protected(this->version,
+					lockdep_is_held(&this->version_lock));
+	rcu_assign_pointer(this->version, version);
+	mutex_unlock(&this->version_lock);
+	if (old)
+		lsm_version_put(old);
+}
+
+static int lsm_version_search(struct lsm_version *this, uint32_t key,
+			      void *val)
+{
+	int err;
+	size_t i;
+	struct record *record;
+	struct lsm_version_level *level;
+
+	for (i = 0; i < this->nr_immutable; ++i) {
+		err = this->immutables[i]->get(this->immutables[i], key,
+					       (void **)&record);
+		if (!err) {
+			*(struct record *)val = *record;
+			DMDEBUG("lsm_tree_search found in immutable_memtable "
+				"lba:%u pba:%llu",
+				key, record->pba);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < this->nr_level; ++i) {
+		level = &this->levels[i];
+		err = bit_files_search(level->files, level->size, level->level,
+				       key, val);
+		if (!err) {
+			DMDEBUG("lsm_tree_search found in bit lba:%u pba:%llu",
+				key, ((struct record *)val)->pba);
+			return 0;
+		}
+	}
+	return -ENODATA;
+}
+
 // log-structured merge tree implementation
 int lsm_tree_major_compaction(struct lsm_tree *this, size_t level)
 {
@@ -1650,6 +1799,7 @@ int lsm_tree_major_compaction(struct lsm_tree *this, size_t level)
 		goto exit;
 	}
 	err = job->run(job);
+	lsm_tree_install_version(this);
 exit:
 	if (job)
 		job->destroy(job);
@@ -1662,9 +1812,8 @@ int lsm_tree_minor_compaction(struct lsm_tree *this, struct memtable *memtable)
 	size_t fd, version;
 	struct lsm_file *file;
 	struct lsm_file_builder *builder;
-	struct memtable_entry *ep;
+	struct iterator *iter;
 	struct entry entry;
-	struct list_head entries;
 #if ENABLE_JOURNAL
 	struct journal_region *journal = jindisk->meta->journal;
 	struct journal_record j_record;
@@ -1673,7 +1822,11 @@ int lsm_tree_minor_compaction(struct lsm_tree *this, struct memtable *memtable)
 	if (this->levels[0]->is_full(this->levels[0]))
 		lsm_tree_major_compaction(this, 0);
 
-	memtable->get_all_entry(memtable, &entries);
+	iter = memtable->iterator(memtable);
+	if (!iter) {
+		DMERR("lsm_tree_minor_compaction create iterator failed");
+		return -ENOMEM;
+	}
 	this->catalogue->alloc_file(this->catalogue, &fd);
 
 	version = this->catalogue->get_next_version(this->catalogue);
@@ -1689,17 +1842,11 @@ int lsm_tree_minor_compaction(struct lsm_tree *this, struct memtable *memtable)
 	j_record.bit_compaction.timestamp = ktime_get_real_ns();
 	journal->jops->add_record(journal, &j_record);
 #endif
-	list_for_each_entry (ep, &entries, list) {
-		entry.key = ep->key;
-		if (ep->val) {
-			entry.val = ep->val;
-			builder->add_entry(builder, &entry);
-		}
-		if (ep->negative_val) {
-			entry.val = ep->negative_val;
-			builder->add_entry(builder, &entry);
-		}
+	while (iter->has_next(iter)) {
+		iter->next(iter, &entry);
+		builder->add_entry(builder, &entry);
 	}
+	iter->destroy(iter);
 
 	file = builder->complete(builder);
 	this->catalogue->set_file_stats(this->catalogue, file->id,
@@ -1717,61 +1864,146 @@ void minor_compaction_handler(struct work_struct *ws)
 	struct compaction_work *cw =
 		container_of(ws, struct compaction_work, work);
 	struct lsm_tree *this = cw->data;
+	struct memtable *memtable;
+
+	// each rotation queues one work, the oldest memtable goes first
+	mutex_lock(&this->im_lock);
+	memtable = this->immutables[0];
+	mutex_unlock(&this->im_lock);
+	if (lsm_tree_minor_compaction(this, memtable)) {
+		DMERR("minor_compaction_handler failed, retrying");
+		queue_work(compaction_wq, &cw->work);
+		return;
+	}
 
-	down_read(&this->im_lock);
-	lsm_tree_minor_compaction(this, this->immutable_memtable);
-	up_read(&this->im_lock);
-	kfree(cw);
+	mutex_lock(&this->im_lock);
+	WRITE_ONCE(this->nr_immutable, this->nr_immutable - 1);
+	memmove(this->immutables, this->immutables + 1,
+		this->nr_immutable * sizeof(struct memtable *));
+	this->immutables[this->nr_immutable] = NULL;
+	mutex_unlock(&this->im_lock);
+	lsm_tree_install_version(this);
+	wake_up_all(&this->im_wait);
+	// versions still listing it keep it alive
+	memtable_put(memtable);
+	mempool_free(cw, compaction_work_pool);
+}
+
+static struct memtable *lsm_tree_memtable_begin(struct lsm_tree *this)
+{
+#if ENABLE_SKIPLIST_MEMTABLE
+	rcu_read_lock();
+	// pairs with the release in lsm_tree_put
+	return smp_load_acquire(&this->memtable);
+#else
+	down_read(&this->m_lock);
+	return this->memtable;
+#endif
+}
+
+static void lsm_tree_memtable_end(struct lsm_tree *this)
+{
+#if ENABLE_SKIPLIST_MEMTABLE
+	rcu_read_unlock();
+#else
+	up_read(&this->m_lock);
+#endif
+}
+
+static struct memtable *lsm_memtable_create(void)
+{
+#if ENABLE_SKIPLIST_MEMTABLE
+	return skiplist_memtable_create(SKIPLIST_ARENA_SIZE);
+#else
+	return rbtree_memtable_create();
+#endif
 }
 
 int lsm_tree_search(struct lsm_tree *this, uint32_t key, void *val)
 {
 	int err = 0;
-	size_t i;
 	struct record *record;
+	struct memtable *memtable;
+	struct lsm_version *version;
 
-	down_read(&this->m_lock);
-	err = this->memtable->get(this->memtable, key, (void **)&record);
-	up_read(&this->m_lock);
-	if (!err) {
+	memtable = lsm_tree_memtable_begin(this);
+	err = memtable->get(memtable, key, (void **)&record);
+	if (!err)
 		*(struct record *)val = *record;
+	lsm_tree_memtable_end(this);
+	if (!err) {
 		DMDEBUG("lsm_tree_search found in memtable lba:%u pba:%llu",
-			key, record->pba);
+			key, ((struct record *)val)->pba);
 		return 0;
 	}
 
-	down_read(&this->im_lock);
-	if (this->immutable_memtable) {
-		err = this->immutable_memtable->get(this->immutable_memtable,
-						    key, (void **)&record);
-		up_read(&this->im_lock);
-		if (!err) {
-			*(struct record *)val = *record;
-			DMDEBUG("lsm_tree_search found in immutable_memtable "
-				"lba:%u pba:%llu",
-				key, record->pba);
-			return 0;
-		}
-	} else
-		up_read(&this->im_lock);
+	version = lsm_version_get(this);
+	err = lsm_version_search(version, key, val);
+	lsm_version_put(version);
+	if (err)
+		DMDEBUG("lsm_tree_search found nodata lba:%u", key);
+	return err;
+}
 
-	for (i = 0; i < this->catalogue->nr_disk_level; ++i) {
-		err = this->levels[i]->search(this->levels[i], key, val);
-		if (!err) {
-			DMDEBUG("lsm_tree_search found in bit lba:%u pba:%llu",
-				key, ((struct record *)val)->pba);
-			return 0;
-		}
-	}
-	DMDEBUG("lsm_tree_search found nodata lba:%u", key);
-	return -ENODATA;
+/*
+ * Slow writers down as immutable memtables queue up for minor compaction,
+ * the more the longer, so that the queue rarely fills. Writers rotating into
+ * a full queue stop in lsm_tree_put until a compaction is done.
+ */
+static void lsm_tree_throttle(struct lsm_tree *this, size_t n)
+{
+	size_t nr = READ_ONCE(this->nr_immutable);
+	unsigned long delay;
+
+	if (nr < SLOWDOWN_IMMUTABLE_MEMTABLES)
+		return;
+	delay = (nr - SLOWDOWN_IMMUTABLE_MEMTABLES + 1) * IMMUTABLE_SLOWDOWN_US;
+	fsleep(delay * n);
+	disk_counter.memtable_slowdowns += 1;
+}
+
+// the memtable replaced a record, its block is stale unless rewritten since
+static void lsm_tree_drop_record(struct lsm_tree *this, uint32_t key,
+				 struct record *old)
+{
+	struct segment_allocator *sa = jindisk->seg_allocator;
+
+	sa->invalidate(sa, old->pba, key);
+	// lock-free lookups may still be copying it
+	kvfree_rcu(old);
+}
+
+// queue the full memtable for minor compaction, called with m_lock held
+static void lsm_tree_rotate(struct lsm_tree *this)
+{
+	struct compaction_work *cw;
+	uint64_t start;
+
+	// only rotations add to the queue, and they hold m_lock
+	if (READ_ONCE(this->nr_immutable) == MAX_IMMUTABLE_MEMTABLES) {
+		start = ktime_get_ns();
+		wait_event(this->im_wait, READ_ONCE(this->nr_immutable) <
+						  MAX_IMMUTABLE_MEMTABLES);
+		disk_counter.memtable_stops += 1;
+		disk_counter.memtable_stop_ns += ktime_get_ns() - start;
+	}
+	mutex_lock(&this->im_lock);
+	this->immutables[this->nr_immutable] = this->memtable;
+	WRITE_ONCE(this->nr_immutable, this->nr_immutable + 1);
+	mutex_unlock(&this->im_lock);
+	// lookups missing in the new memtable find the old one listed
+	lsm_tree_install_version(this);
+	smp_store_release(&this->memtable, lsm_memtable_create());
+
+	cw = mempool_alloc(compaction_work_pool, GFP_NOIO);
+	cw->data = this;
+	INIT_WORK(&cw->work, minor_compaction_handler);
+	queue_work(compaction_wq, &cw->work);
 }
 
 void lsm_tree_put(struct lsm_tree *this, uint32_t key, void *val)
 {
-	dm_block_t old_lba, new_lba;
 	struct record *old;
-	struct compaction_work *cw;
 
 #if defined(DEBUG)
 	if (val)
@@ -1780,126 +2012,137 @@ void lsm_tree_put(struct lsm_tree *this, uint32_t key, void *val)
 	else
 		DMDEBUG("lsm_tree_put lba:%u negative", key);
 #endif
+	lsm_tree_throttle(this, 1);
 	down_write(&this->m_lock);
 	old = this->memtable->put(this->memtable, key, val, record_destroy);
-	if (old) {
-		old_lba = key;
-		jindisk->meta->rit->reset(jindisk->meta->rit, old->pba, old_lba,
-					  &new_lba);
-		if (old_lba == new_lba)
-			jindisk->meta->dst->return_block(jindisk->meta->dst,
-							 old->pba);
-		record_destroy(old);
-	}
-
-	if (this->memtable->size >= DEFAULT_MEMTABLE_CAPACITY) {
-		down_write(&this->im_lock);
-		if (this->immutable_memtable)
-			this->immutable_memtable->destroy(
-				this->immutable_memtable);
-		this->immutable_memtable = this->memtable;
-		up_write(&this->im_lock);
-		this->memtable = rbtree_memtable_create();
-
-		cw = kzalloc(sizeof(struct compaction_work), GFP_KERNEL);
-		cw->data = this;
-		INIT_WORK(&cw->work, minor_compaction_handler);
-		queue_work(compaction_wq, &cw->work);
+	if (old)
+		lsm_tree_drop_record(this, key, old);
+	if (this->memtable->full(this->memtable))
+		lsm_tree_rotate(this);
+	up_write(&this->m_lock);
+}
+
+/*
+ * Put the records of a flushed run of blocks, keys[i] => records[i], taking
+ * m_lock once for the whole run. A NULL record is a negative one, as in
+ * lsm_tree_put.
+ */
+void lsm_tree_put_batch(struct lsm_tree *this, uint32_t *keys,
+			struct record **records, size_t n)
+{
+	size_t i;
+	struct record *old;
+
+	if (!n)
+		return;
+
+	DMDEBUG("lsm_tree_put_batch lba:%u count:%lu", keys[0], n);
+	lsm_tree_throttle(this, n);
+	down_write(&this->m_lock);
+	for (i = 0; i < n; i++) {
+		old = this->memtable->put(this->memtable, keys[i], records[i],
+					  record_destroy);
+		if (old)
+			lsm_tree_drop_record(this, keys[i], old);
+		if (this->memtable->full(this->memtable))
+			lsm_tree_rotate(this);
 	}
 	up_write(&this->m_lock);
 }
 
-// search records for each lba in [start, end]
-struct memtable *lsm_tree_range_search(struct lsm_tree *this, uint32_t start,
-				       uint32_t end)
+/*
+ * Look up the records of [start, start + count). The record of lba is stored
+ * in records[lba - start] and bit (lba - start) of found is set; both arrays
+ * are provided by the caller and must hold count entries.
+ *
+ * Return: the number of lbas found
+ */
+int lsm_tree_range_search(struct lsm_tree *this, uint32_t start,
+			  uint32_t count, struct record *records,
+			  unsigned long *found)
 {
 	int err, i;
-	uint32_t key, count;
+	uint32_t key, end = start + count - 1;
 	struct record *valid;
-	struct memtable *results = rbtree_memtable_create();
-	unsigned long *found = NULL;
+	struct memtable *memtable;
+	struct lsm_version *version;
+	struct lsm_version_level *level;
 
-	if (start > end)
-		goto out;
+	bitmap_zero(found, count);
+	if (!count)
+		return 0;
 
 	DMDEBUG("lsm_tree_range_search [%u, %u]", start, end);
-	count = end - start + 1;
-	found = bitmap_zalloc(count, GFP_KERNEL);
-	if (!found) {
-		DMERR("lsm_tree_range_search bitmap_zalloc failed");
-		goto out;
-	}
-	down_read(&this->m_lock);
+	memtable = lsm_tree_memtable_begin(this);
 	for (key = start; key <= end; key++) {
-		err = this->memtable->get(this->memtable, key, (void **)&valid);
+		err = memtable->get(memtable, key, (void **)&valid);
 		if (!err) {
-			results->put(results, key, record_copy(valid),
-				     record_destroy);
+			records[key - start] = *valid;
 			set_bit(key - start, found);
 		}
 	}
-	up_read(&this->m_lock);
-	if (results->size == count)
+	lsm_tree_memtable_end(this);
+	if (bitmap_full(found, count))
 		goto out;
 
-	down_read(&this->im_lock);
-	if (this->immutable_memtable) {
+	version = lsm_version_get(this);
+	for (i = 0; i < version->nr_immutable; ++i) {
 		for (key = start; key <= end; key++) {
 			if (test_bit(key - start, found))
 				continue;
 
-			err = this->immutable_memtable->get(
-				this->immutable_memtable, key, (void **)&valid);
+			err = version->immutables[i]->get(
+				version->immutables[i], key, (void **)&valid);
 			if (!err) {
-				results->put(results, key, record_copy(valid),
-					     record_destroy);
+				records[key - start] = *valid;
 				set_bit(key - start, found);
 			}
 		}
-		up_read(&this->im_lock);
-	} else {
-		up_read(&this->im_lock);
+		if (bitmap_full(found, count))
+			goto put;
 	}
-	if (results->size == count)
-		goto out;
 
 	// bit_file range_search
-	for (i = 0; i < this->catalogue->nr_disk_level; ++i) {
-		down_read(&this->levels[i]->l_lock);
-		bit_level_range_search(this->levels[i], start, end, results,
-				       found);
-		up_read(&this->levels[i]->l_lock);
-		if (results->size == count)
-			goto out;
-	}
+	for (i = 0; i < version->nr_level; ++i) {
+		level = &version->levels[i];
+		bit_files_range_search(level->files, level->size, level->level,
+				       start, end, records, found);
+		if (bitmap_full(found, count))
+			goto put;
+	}
+put:
+	lsm_version_put(version);
 out:
-	if (found)
-		kfree(found);
-	if (results->size == 0) {
-		results->destroy(results);
-		results = NULL;
-		DMDEBUG("lsm_tree_range_search found nodata [%u, %u]", start,
-			end);
-	}
-	return results;
+	return bitmap_weight(found, count);
 }
 
 void lsm_tree_destroy(struct lsm_tree *this)
 {
 	size_t i;
+	struct lsm_version *version;
 
+	// queued compactions go first, the memtable is compacted here
 	if (compaction_wq)
-		destroy_workqueue(compaction_wq);
+		flush_workqueue(compaction_wq);
 
 	if (!IS_ERR_OR_NULL(this)) {
-		if (this->immutable_memtable)
-			this->immutable_memtable->destroy(
-				this->immutable_memtable);
 		if (!IS_ERR_OR_NULL(this->memtable)) {
 			if (this->memtable->size)
 				lsm_tree_minor_compaction(this, this->memtable);
 			this->memtable->destroy(this->memtable);
 		}
+		version = rcu_dereference_protected(this->version, true);
+		if (version)
+			lsm_version_put(version);
+		// old versions are freed on compaction_wq after a grace period
+		rcu_barrier();
+	}
+	if (compaction_wq)
+		destroy_workqueue(compaction_wq);
+	mempool_destroy(compaction_work_pool);
+	compaction_work_pool = NULL;
+
+	if (!IS_ERR_OR_NULL(this)) {
 		if (!IS_ERR_OR_NULL(this->levels)) {
 			for (i = 0; i < this->catalogue->nr_disk_level; ++i)
 				this->levels[i]->destroy(this->levels[i]);
@@ -1931,12 +2174,22 @@ int lsm_tree_init(struct lsm_tree *this, const char *filename,
 		err = -EAGAIN;
 		goto bad;
 	}
+	compaction_work_pool =
+		mempool_create_kmalloc_pool(1, sizeof(struct compaction_work));
+	if (!compaction_work_pool) {
+		DMERR("mempool_create compaction_work failed");
+		err = -ENOMEM;
+		goto bad;
+	}
 
 	this->catalogue = catalogue;
-	this->memtable = rbtree_memtable_create();
-	this->immutable_memtable = NULL;
+	this->memtable = lsm_memtable_create();
+	this->nr_immutable = 0;
 	init_rwsem(&this->m_lock);
-	init_rwsem(&this->im_lock);
+	mutex_init(&this->im_lock);
+	init_waitqueue_head(&this->im_wait);
+	RCU_INIT_POINTER(this->version, NULL);
+	mutex_init(&this->version_lock);
 	this->levels =
 		kzalloc(catalogue->nr_disk_level * sizeof(struct lsm_level *),
 			GFP_KERNEL);
@@ -1964,8 +2217,10 @@ int lsm_tree_init(struct lsm_tree *this, const char *filename,
 						    lsm_file);
 		kfree(stat);
 	}
+	lsm_tree_install_version(this);
 
 	this->put = lsm_tree_put;
+	this->put_batch = lsm_tree_put_batch;
 	this->search = lsm_tree_search;
 	this->range_search = lsm_tree_range_search;
 	this->destroy = lsm_tree_destroy;
@@ -1973,6 +2228,8 @@ int lsm_tree_init(struct lsm_tree *this, const char *filename,
 bad:
 	if (compaction_wq)
 		destroy_workqueue(compaction_wq);
+	mempool_destroy(compaction_work_pool);
+	compaction_work_pool = NULL;
 	if (this->file)
 		filp_close(this->file, NULL);
 	if (this->levels)
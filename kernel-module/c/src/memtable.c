@@ -5,8 +5,10 @@
  */
 
 #include <linux/random.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/sort.h>
+#include <linux/vmalloc.h>
 
 #include "../include/crypto.h"
 #include "../include/dm_jindisk.h"
@@ -247,6 +249,90 @@ int rbtree_memtable_get_all_entry(struct memtable *memtable,
 	return 0;
 }
 
+struct rbtree_memtable_iterator {
+	struct iterator iterator;
+	struct rb_node *node;
+	bool negative;
+};
+
+// stop at the next record to return, the value before the negative one
+static void rbtree_memtable_iterator_settle(struct rbtree_memtable_iterator *it)
+{
+	struct memtable_entry *entry;
+
+	for (; it->node; it->node = rb_next(it->node), it->negative = false) {
+		entry = rb_entry(it->node, struct memtable_entry, rb);
+		if (!it->negative && entry->val)
+			return;
+		if (entry->negative_val) {
+			it->negative = true;
+			return;
+		}
+	}
+}
+
+bool rbtree_memtable_iterator_has_next(struct iterator *iterator)
+{
+	struct rbtree_memtable_iterator *it = container_of(
+		iterator, struct rbtree_memtable_iterator, iterator);
+
+	return it->node;
+}
+
+int rbtree_memtable_iterator_next(struct iterator *iterator, void *data)
+{
+	struct entry *result = data;
+	struct memtable_entry *entry;
+	struct rbtree_memtable_iterator *it = container_of(
+		iterator, struct rbtree_memtable_iterator, iterator);
+
+	if (!it->node)
+		return -ENODATA;
+
+	entry = rb_entry(it->node, struct memtable_entry, rb);
+	result->key = entry->key;
+	if (it->negative) {
+		result->val = entry->negative_val;
+		it->node = rb_next(it->node);
+		it->negative = false;
+	} else {
+		result->val = entry->val;
+		it->negative = true;
+	}
+	rbtree_memtable_iterator_settle(it);
+	return 0;
+}
+
+void rbtree_memtable_iterator_destroy(struct iterator *iterator)
+{
+	kfree(container_of(iterator, struct rbtree_memtable_iterator,
+			   iterator));
+}
+
+struct iterator *rbtree_memtable_iterator(struct memtable *memtable)
+{
+	struct rbtree_memtable_iterator *it;
+	struct rbtree_memtable *this =
+		container_of(memtable, struct rbtree_memtable, memtable);
+
+	it = kzalloc(sizeof(struct rbtree_memtable_iterator), GFP_KERNEL);
+	if (!it)
+		return NULL;
+
+	it->node = rb_first(&this->root);
+	rbtree_memtable_iterator_settle(it);
+	it->iterator.private = memtable;
+	it->iterator.has_next = rbtree_memtable_iterator_has_next;
+	it->iterator.next = rbtree_memtable_iterator_next;
+	it->iterator.destroy = rbtree_memtable_iterator_destroy;
+	return &it->iterator;
+}
+
+bool rbtree_memtable_full(struct memtable *memtable)
+{
+	return memtable->size >= DEFAULT_MEMTABLE_CAPACITY;
+}
+
 void rbtree_memtable_clear(struct memtable *memtable)
 {
 	struct memtable_entry *entry;
@@ -276,9 +362,12 @@ void rbtree_memtable_init(struct rbtree_memtable *this)
 	this->root = RB_ROOT;
 	// memtable
 	this->memtable.size = 0;
+	refcount_set(&this->memtable.refs, 1);
 	this->memtable.put = rbtree_memtable_put;
 	this->memtable.get = rbtree_memtable_get;
 	this->memtable.get_all_entry = rbtree_memtable_get_all_entry;
+	this->memtable.iterator = rbtree_memtable_iterator;
+	this->memtable.full = rbtree_memtable_full;
 	this->memtable.contains = rbtree_memtable_contains;
 	this->memtable.destroy = rbtree_memtable_destroy;
 	this->memtable.remove = rbtree_memtable_remove;
@@ -296,3 +385,304 @@ struct memtable *rbtree_memtable_create(void)
 	rbtree_memtable_init(this);
 	return &this->memtable;
 }
+
+// skiplist memtable implementation
+#define SKIPLIST_NODE_SIZE(height)                                             \
+	(sizeof(struct skiplist_node) + (height) * sizeof(void *))
+
+static void *skiplist_arena_alloc(struct skiplist_memtable *this, size_t size)
+{
+	void *p;
+
+	size = ALIGN(size, sizeof(void *));
+	if (this->arena_used + size > this->arena_size)
+		return NULL;
+	p = this->arena + this->arena_used;
+	this->arena_used += size;
+	return p;
+}
+
+// every level up is taken with probability 1/4
+static int skiplist_random_height(void)
+{
+	int height = 1;
+	u32 bits = get_random_u32();
+
+	while (height < SKIPLIST_MAX_HEIGHT && !(bits & 3)) {
+		height += 1;
+		bits >>= 2;
+	}
+	return height;
+}
+
+/*
+ * Find the last node before key at each level. Only readers race with it,
+ * the result is exact for the writer holding the lock.
+ */
+static struct skiplist_node *
+skiplist_find(struct skiplist_memtable *this, memtable_key_t key,
+	      struct skiplist_node **prev)
+{
+	int level;
+	struct skiplist_node *node = this->head, *next = NULL;
+
+	for (level = READ_ONCE(this->height) - 1; level >= 0; level--) {
+		// pairs with the release in skiplist_memtable_put
+		next = smp_load_acquire(&node->next[level]);
+		while (next && next->key < key) {
+			node = next;
+			next = smp_load_acquire(&node->next[level]);
+		}
+		if (prev)
+			prev[level] = node;
+	}
+	if (next && next->key == key)
+		return next;
+	return NULL;
+}
+
+// negative record if val == NULL
+void *skiplist_memtable_put(struct memtable *memtable, memtable_key_t key,
+			    void *val, dtr_fn_t dtr_fn)
+{
+	int i, height;
+	void *old = NULL;
+	struct skiplist_node *node, *prev[SKIPLIST_MAX_HEIGHT];
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	if (!val)
+		val = this->negative;
+
+	mutex_lock(&this->lock);
+	for (i = READ_ONCE(this->height); i < SKIPLIST_MAX_HEIGHT; i++)
+		prev[i] = this->head;
+	node = skiplist_find(this, key, prev);
+	if (node) {
+		old = node->val;
+		smp_store_release(&node->val, val);
+		if (old == this->negative) {
+			old = NULL;
+		} else if (val == this->negative) {
+			// gets may still copy it, as for the caller's copy
+			kvfree_rcu(old);
+			old = NULL;
+		}
+		goto out;
+	}
+
+	height = skiplist_random_height();
+	node = skiplist_arena_alloc(this, SKIPLIST_NODE_SIZE(height));
+	if (!node) {
+		DMERR("skiplist_memtable_put arena is full");
+		goto out;
+	}
+	node->key = key;
+	node->height = height;
+	node->val = val;
+	for (i = 0; i < height; i++)
+		node->next[i] = prev[i]->next[i];
+	// link from the bottom up, a node found at a level is complete
+	for (i = 0; i < height; i++)
+		smp_store_release(&prev[i]->next[i], node);
+	if (height > this->height)
+		WRITE_ONCE(this->height, height);
+	memtable->size += 1;
+out:
+	mutex_unlock(&this->lock);
+	return old;
+}
+
+int skiplist_memtable_get(struct memtable *memtable, memtable_key_t key,
+			  void **p_val)
+{
+	struct skiplist_node *node;
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	node = skiplist_find(this, key, NULL);
+	if (!node)
+		return -ENODATA;
+	*p_val = smp_load_acquire(&node->val);
+	return 0;
+}
+
+bool skiplist_memtable_contains(struct memtable *memtable, memtable_key_t key)
+{
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	return skiplist_find(this, key, NULL);
+}
+
+// unlinked nodes stay in the arena, readers on them still find their way
+void *skiplist_memtable_remove(struct memtable *memtable, memtable_key_t key)
+{
+	int i;
+	void *val = NULL;
+	struct skiplist_node *node, *prev[SKIPLIST_MAX_HEIGHT];
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	mutex_lock(&this->lock);
+	node = skiplist_find(this, key, prev);
+	if (node) {
+		for (i = node->height - 1; i >= 0; i--)
+			WRITE_ONCE(prev[i]->next[i], node->next[i]);
+		val = node->val == this->negative ? NULL : node->val;
+		memtable->size -= 1;
+	}
+	mutex_unlock(&this->lock);
+	return val;
+}
+
+int skiplist_memtable_get_all_entry(struct memtable *memtable,
+				    struct list_head *entries)
+{
+	INIT_LIST_HEAD(entries);
+	return -EOPNOTSUPP;
+}
+
+struct skiplist_memtable_iterator {
+	struct iterator iterator;
+	struct skiplist_node *node;
+};
+
+bool skiplist_memtable_iterator_has_next(struct iterator *iterator)
+{
+	struct skiplist_memtable_iterator *it = container_of(
+		iterator, struct skiplist_memtable_iterator, iterator);
+
+	return it->node;
+}
+
+int skiplist_memtable_iterator_next(struct iterator *iterator, void *data)
+{
+	struct entry *entry = data;
+	struct skiplist_memtable_iterator *it = container_of(
+		iterator, struct skiplist_memtable_iterator, iterator);
+
+	if (!it->node)
+		return -ENODATA;
+
+	entry->key = it->node->key;
+	entry->val = smp_load_acquire(&it->node->val);
+	it->node = smp_load_acquire(&it->node->next[0]);
+	return 0;
+}
+
+void skiplist_memtable_iterator_destroy(struct iterator *iterator)
+{
+	kfree(container_of(iterator, struct skiplist_memtable_iterator,
+			   iterator));
+}
+
+struct iterator *skiplist_memtable_iterator(struct memtable *memtable)
+{
+	struct skiplist_memtable_iterator *it;
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	it = kzalloc(sizeof(struct skiplist_memtable_iterator), GFP_KERNEL);
+	if (!it)
+		return NULL;
+
+	it->node = smp_load_acquire(&this->head->next[0]);
+	it->iterator.private = memtable;
+	it->iterator.has_next = skiplist_memtable_iterator_has_next;
+	it->iterator.next = skiplist_memtable_iterator_next;
+	it->iterator.destroy = skiplist_memtable_iterator_destroy;
+	return &it->iterator;
+}
+
+// a full memtable still has room for the put that fills it
+bool skiplist_memtable_full(struct memtable *memtable)
+{
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	// a minor compaction writes it to one file of that many records
+	if (memtable->size >= DEFAULT_MEMTABLE_CAPACITY)
+		return true;
+	return this->arena_used + SKIPLIST_NODE_SIZE(SKIPLIST_MAX_HEIGHT) >
+	       this->arena_size;
+}
+
+// no reader may be left
+void skiplist_memtable_clear(struct memtable *memtable)
+{
+	int i;
+	struct skiplist_node *node;
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	for (node = this->head->next[0]; node; node = node->next[0]) {
+		if (node->val != this->negative)
+			record_destroy(node->val);
+	}
+	for (i = 0; i < SKIPLIST_MAX_HEIGHT; i++)
+		this->head->next[i] = NULL;
+	this->height = 1;
+	memtable->size = 0;
+}
+
+void skiplist_memtable_destroy(struct memtable *memtable)
+{
+	struct skiplist_memtable *this =
+		container_of(memtable, struct skiplist_memtable, memtable);
+
+	skiplist_memtable_clear(memtable);
+	vfree(this->arena);
+	kfree(this);
+}
+
+int skiplist_memtable_init(struct skiplist_memtable *this, size_t arena_size)
+{
+	struct record *negative;
+
+	this->arena = vmalloc(arena_size);
+	if (!this->arena)
+		return -ENOMEM;
+	this->arena_size = arena_size;
+	this->arena_used = 0;
+	mutex_init(&this->lock);
+
+	this->head = skiplist_arena_alloc(
+		this, SKIPLIST_NODE_SIZE(SKIPLIST_MAX_HEIGHT));
+	memset(this->head, 0, SKIPLIST_NODE_SIZE(SKIPLIST_MAX_HEIGHT));
+	this->head->height = SKIPLIST_MAX_HEIGHT;
+	this->height = 1;
+	// shared by all negative entries, pba INF_ADDR and no key
+	negative = skiplist_arena_alloc(this, sizeof(struct record));
+	memset(negative, 0, sizeof(struct record));
+	negative->pba = INF_ADDR;
+	this->negative = negative;
+
+	this->memtable.size = 0;
+	refcount_set(&this->memtable.refs, 1);
+	this->memtable.put = skiplist_memtable_put;
+	this->memtable.get = skiplist_memtable_get;
+	this->memtable.get_all_entry = skiplist_memtable_get_all_entry;
+	this->memtable.iterator = skiplist_memtable_iterator;
+	this->memtable.full = skiplist_memtable_full;
+	this->memtable.contains = skiplist_memtable_contains;
+	this->memtable.destroy = skiplist_memtable_destroy;
+	this->memtable.remove = skiplist_memtable_remove;
+	this->memtable.clear = skiplist_memtable_clear;
+	return 0;
+}
+
+struct memtable *skiplist_memtable_create(size_t arena_size)
+{
+	struct skiplist_memtable *this = NULL;
+
+	this = kmalloc(sizeof(struct skiplist_memtable), GFP_KERNEL);
+	if (!this)
+		return NULL;
+
+	if (skiplist_memtable_init(this, arena_size)) {
+		kfree(this);
+		return NULL;
+	}
+	return &this->memtable;
+}
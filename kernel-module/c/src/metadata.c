@@ -512,6 +512,23 @@ int reverse_index_table_set(struct reverse_index_table *this, dm_block_t pba,
 	return r;
 }
 
+// lbas[i] is the lba of pba + i
+int reverse_index_table_set_range(struct reverse_index_table *this,
+				  dm_block_t pba, size_t count,
+				  dm_block_t *lbas)
+{
+	int r = 0;
+
+	// an entry is nothing but its lba
+	BUILD_BUG_ON(sizeof(struct reverse_index_entry) != sizeof(dm_block_t));
+	DMDEBUG("reverse_index_table_set_range pba:%llu count:%lu", pba,
+		count);
+	down_write(&this->rit_lock);
+	r = this->array->set_range(this->array, pba, count, lbas);
+	up_write(&this->rit_lock);
+	return r;
+}
+
 int reverse_index_table_get(struct reverse_index_table *this, dm_block_t pba,
 			    dm_block_t *lba)
 {
@@ -546,6 +563,7 @@ int reverse_index_table_init(struct reverse_index_table *this,
 
 	this->format = reverse_index_table_format;
 	this->set = reverse_index_table_set;
+	this->set_range = reverse_index_table_set_range;
 	this->get = reverse_index_table_get;
 	this->reset = reverse_index_table_reset;
 	return 0;
@@ -799,6 +817,51 @@ out:
 	return err;
 }
 
+// return blocks sorted by pba, each segment entry is updated once
+int dst_return_blocks(struct dst *this, dm_block_t *pbas, size_t count)
+{
+	int err = 0;
+	struct dst_entry entry;
+	size_t i, j, segno, offset;
+
+	down_write(&this->dst_lock);
+	for (i = 0; i < count; i = j) {
+		segno = __block_to_segment(pbas[i]);
+		j = i + 1;
+		while (j < count && __block_to_segment(pbas[j]) == segno)
+			j++;
+		err = this->array->get(this->array, segno, &entry);
+		if (err || !entry.nr_valid_block) {
+			DMERR("dst_return_blocks failed segno:%lu nr_valid:%lu "
+			      "err:%d",
+			      segno, entry.nr_valid_block, err);
+			continue;
+		}
+
+		for (; i < j; i++) {
+			offset = __block_offset_whthin_segment(pbas[i]);
+			if (test_and_clear_bit(offset,
+					       entry.block_validity_table))
+				entry.nr_valid_block -= 1;
+			else
+				DMERR("dst_return_blocks has been cleared "
+				      "pba:%llu",
+				      pbas[i]);
+		}
+		err = this->array->set(this->array, segno, &entry);
+		if (err) {
+			DMERR("dst_return_blocks set failed segno:%lu err:%d",
+			      segno, err);
+			continue;
+		}
+		err = dst_update_victim(this, segno, entry.nr_valid_block,
+					entry.block_validity_table);
+	}
+	up_write(&this->dst_lock);
+	DMDEBUG("dst_return_blocks count:%lu err:%d", count, err);
+	return err;
+}
+
 int dst_find_logging_block(struct dst *this, dm_block_t *pba)
 {
 	int err = 0, offset;
@@ -952,6 +1015,7 @@ int dst_init(struct dst *this, struct dm_bufio_client *bc, char *key,
 	this->return_segment = dst_return_segment;
 	this->take_block = dst_take_block;
 	this->return_block = dst_return_block;
+	this->return_blocks = dst_return_blocks;
 	this->find_logging_block = dst_find_logging_block;
 	this->victim_empty = dst_victim_empty;
 	this->peek_victim = dst_peek_victim;
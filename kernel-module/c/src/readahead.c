@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2022 Ant Group CO., Ltd. All rights reserved.
+ *
+ * This file is released under the GPLv2.
+ */
+
+#include <linux/jiffies.h>
+#include <linux/vmalloc.h>
+
+#include "../include/dm_jindisk.h"
+#include "../include/readahead.h"
+#include "../include/segment_buffer.h"
+
+struct readahead_work {
+	struct work_struct work;
+	struct stream_readahead *ra;
+	dm_block_t start;
+	size_t count;
+	/* lookup state of the chunk being read, indexed by lba - chunk start */
+	struct record records[MAX_NR_FETCH];
+	DECLARE_BITMAP(found, MAX_NR_FETCH);
+	struct blk_info blks[MAX_NR_FETCH];
+	struct aead_msg msgs[MAX_NR_FETCH];
+};
+static struct workqueue_struct *readahead_wq;
+
+/*
+ * Read a contiguous run of ciphertext and decrypt it into the data cache.
+ * The generations were sampled before the index lookup, see block_cache.
+ */
+static void readahead_fill(struct blk_info *blks, int nr, void *buffer,
+			   struct aead_msg *msgs)
+{
+	struct block_cache *cache = jindisk->data_cache;
+	int i;
+
+	jindisk_read_blocks(blks[0].record->pba, nr, buffer, DM_IO_VMA, NULL);
+	for (i = 0; i < nr; i++) {
+		msgs[i].data = (char *)buffer + i * DATA_BLOCK_SIZE;
+		msgs[i].out = msgs[i].data;
+		msgs[i].len = DATA_BLOCK_SIZE;
+		msgs[i].key = blks[i].record->key;
+		msgs[i].iv = NULL;
+		msgs[i].mac = blks[i].record->mac;
+		msgs[i].seq = blks[i].record->pba;
+		msgs[i].done = NULL;
+	}
+	jindisk->cipher->decrypt_many(jindisk->cipher, msgs, nr);
+	for (i = 0; i < nr; i++) {
+		if (!msgs[i].err)
+			cache->put(cache, blks[i].lba, msgs[i].out,
+				   blks[i].gen);
+	}
+	disk_counter.readahead_blocks += nr;
+}
+
+static void readahead_chunk(struct readahead_work *rw, dm_block_t start,
+			    size_t count, void *buffer)
+{
+	struct block_cache *cache = jindisk->data_cache;
+	struct blk_info *blks = rw->blks;
+	struct record *record;
+	uint64_t gens[MAX_NR_FETCH];
+	int i, nr = 0;
+
+	for (i = 0; i < count; i++)
+		gens[i] = cache->generation(cache, start + i);
+
+	if (!jindisk->lsm_tree->range_search(jindisk->lsm_tree, start, count,
+					     rw->records, rw->found))
+		return;
+
+	for (i = 0; i < count; i++) {
+		record = &rw->records[i];
+		if (!test_bit(i, rw->found) || record->pba == INF_ADDR)
+			continue;
+
+		if (nr && blks[nr - 1].record->pba + 1 != record->pba) {
+			readahead_fill(blks, nr, buffer, rw->msgs);
+			nr = 0;
+		}
+		blks[nr].lba = start + i;
+		blks[nr].record = record;
+		blks[nr].gen = gens[i];
+		nr += 1;
+	}
+	if (nr)
+		readahead_fill(blks, nr, buffer, rw->msgs);
+}
+
+static void readahead_handler(struct work_struct *ws)
+{
+	struct readahead_work *rw =
+		container_of(ws, struct readahead_work, work);
+	void *buffer = NULL;
+	dm_block_t lba, end = rw->start + rw->count;
+	size_t count;
+
+	buffer = vmalloc(MAX_NR_FETCH * DATA_BLOCK_SIZE);
+	if (!buffer) {
+		DMERR("readahead_handler alloc failed");
+		goto out;
+	}
+
+	DMDEBUG("readahead start:%llu count:%lu", rw->start, rw->count);
+	for (lba = rw->start; lba < end; lba += count) {
+		count = min_t(size_t, end - lba, MAX_NR_FETCH);
+		readahead_chunk(rw, lba, count, buffer);
+	}
+out:
+	vfree(buffer);
+	atomic_dec(&rw->ra->inflight);
+	kfree(rw);
+}
+
+static void readahead_submit(struct stream_readahead *this, dm_block_t start,
+			     size_t count)
+{
+	struct readahead_work *rw;
+
+	if (atomic_inc_return(&this->inflight) > RA_MAX_INFLIGHT)
+		goto busy;
+
+	rw = kmalloc(sizeof(struct readahead_work), GFP_NOIO);
+	if (!rw)
+		goto busy;
+
+	rw->ra = this;
+	rw->start = start;
+	rw->count = count;
+	INIT_WORK(&rw->work, readahead_handler);
+	queue_work(readahead_wq, &rw->work);
+	return;
+busy:
+	atomic_dec(&this->inflight);
+}
+
+static struct ra_stream *readahead_find_stream(struct stream_readahead *this,
+					       dm_block_t start)
+{
+	struct ra_stream *stream, *victim = &this->streams[0];
+	int i;
+
+	for (i = 0; i < RA_NR_STREAMS; i++) {
+		stream = &this->streams[i];
+		if (stream->nr_seq && stream->next == start)
+			return stream;
+		if (time_before(stream->last_used, victim->last_used))
+			victim = stream;
+	}
+	victim->nr_seq = 0;
+	victim->ra_start = victim->ra_end = 0;
+	victim->window = RA_MIN_WINDOW;
+	return victim;
+}
+
+/*
+ * The window doubles while the prefetched blocks are found in the cache and
+ * halves when a read inside the prefetched range still had to go to disk,
+ * either because the prefetch lagged behind or the cache could not hold it.
+ */
+void readahead_observe(struct readahead *ra, dm_block_t start, size_t count,
+		       size_t hits)
+{
+	struct stream_readahead *this =
+		container_of(ra, struct stream_readahead, readahead);
+	struct ra_stream *stream;
+	dm_block_t end = start + count;
+	dm_block_t limit = NR_SEGMENT * BLOCKS_PER_SEGMENT;
+	dm_block_t ra_start = 0;
+	size_t ra_count = 0;
+
+	spin_lock(&this->lock);
+	stream = readahead_find_stream(this, start);
+	stream->last_used = jiffies;
+	stream->next = end;
+	stream->nr_seq += 1;
+	if (stream->nr_seq < 2)
+		goto out;
+
+	if (start >= stream->ra_start && end <= stream->ra_end) {
+		if (hits == count)
+			stream->window = min_t(size_t, stream->window << 1,
+					       RA_MAX_WINDOW);
+		else
+			stream->window = max_t(size_t, stream->window >> 1,
+					       RA_MIN_WINDOW);
+	}
+
+	/* keep at least half a window prefetched ahead of the reader */
+	if (end + (stream->window >> 1) < stream->ra_end)
+		goto out;
+
+	ra_start = max(end, stream->ra_end);
+	if (ra_start >= limit)
+		goto out;
+	ra_count = min_t(size_t, stream->window, limit - ra_start);
+	stream->ra_start = ra_start;
+	stream->ra_end = ra_start + ra_count;
+out:
+	spin_unlock(&this->lock);
+	if (ra_count)
+		readahead_submit(this, ra_start, ra_count);
+}
+
+void readahead_destroy(struct readahead *ra)
+{
+	struct stream_readahead *this =
+		container_of(ra, struct stream_readahead, readahead);
+
+	if (readahead_wq)
+		destroy_workqueue(readahead_wq);
+	kfree(this);
+}
+
+int readahead_init(struct stream_readahead *this)
+{
+	int i;
+
+	readahead_wq = alloc_workqueue("jindisk-ra", WQ_UNBOUND,
+				       RA_MAX_INFLIGHT);
+	if (!readahead_wq) {
+		DMERR("alloc_workqueue jindisk-ra failed");
+		return -EAGAIN;
+	}
+
+	spin_lock_init(&this->lock);
+	atomic_set(&this->inflight, 0);
+	for (i = 0; i < RA_NR_STREAMS; i++) {
+		this->streams[i].nr_seq = 0;
+		this->streams[i].window = RA_MIN_WINDOW;
+		this->streams[i].last_used = jiffies;
+	}
+
+	this->readahead.observe = readahead_observe;
+	this->readahead.destroy = readahead_destroy;
+	return 0;
+}
+
+struct readahead *readahead_create(void)
+{
+	int r;
+	struct stream_readahead *this;
+
+	this = kzalloc(sizeof(struct stream_readahead), GFP_KERNEL);
+	if (!this)
+		return NULL;
+
+	r = readahead_init(this);
+	if (r) {
+		kfree(this);
+		return NULL;
+	}
+	return &this->readahead;
+}
@@ -5,6 +5,7 @@
  */
 
 #include <linux/dm-io.h>
+#include <linux/sort.h>
 #include <linux/timer.h>
 
 #include "../include/dm_jindisk.h"
@@ -61,6 +62,100 @@ int sa_alloc(struct segment_allocator *al, size_t *seg)
 	return 0;
 }
 
+static int stale_block_cmp(const void *a, const void *b)
+{
+	const struct stale_block *x = a, *y = b;
+
+	if (x->pba == y->pba)
+		return 0;
+	return x->pba < y->pba ? -1 : 1;
+}
+
+// drop pba from the rit and dst unless it was rewritten with another lba
+static void sa_invalidate_block(dm_block_t pba, dm_block_t lba)
+{
+	dm_block_t cur = INF_ADDR;
+
+	jindisk->meta->rit->reset(jindisk->meta->rit, pba, lba, &cur);
+	if (cur == lba)
+		jindisk->meta->dst->return_block(jindisk->meta->dst, pba);
+}
+
+/*
+ * Log a block overwritten in the index, so that the rit and dst updates leave
+ * the write path. The log is drained in batches sorted by pba, a full log
+ * falls back to invalidating the block right away.
+ */
+void sa_invalidate(struct segment_allocator *al, dm_block_t pba,
+		   dm_block_t lba)
+{
+	bool logged = false, kick = false;
+	struct default_segment_allocator *this = container_of(
+		al, struct default_segment_allocator, segment_allocator);
+
+	spin_lock(&this->stale_lock);
+	if (this->nr_stale < STALE_LOG_SIZE) {
+		this->stale[this->nr_stale].pba = pba;
+		this->stale[this->nr_stale].lba = lba;
+		this->nr_stale += 1;
+		logged = true;
+		kick = this->nr_stale >= STALE_LOG_BATCH;
+	}
+	spin_unlock(&this->stale_lock);
+	if (kick)
+		queue_work(gc_wq, &this->drain_work);
+	if (!logged)
+		sa_invalidate_block(pba, lba);
+}
+
+/*
+ * Invalidate every block logged so far. The gc drains before returning a
+ * segment, so no stale block of it is left to be dropped after the segment
+ * is reused. Checkpoints and commits drain before writing the metadata.
+ */
+void sa_drain(struct segment_allocator *al)
+{
+	size_t i, nr, nr_returned = 0;
+	dm_block_t cur;
+	struct stale_block *blocks;
+	struct default_segment_allocator *this = container_of(
+		al, struct default_segment_allocator, segment_allocator);
+
+	mutex_lock(&this->drain_lock);
+	spin_lock(&this->stale_lock);
+	blocks = this->stale;
+	nr = this->nr_stale;
+	this->stale = this->spare;
+	this->nr_stale = 0;
+	spin_unlock(&this->stale_lock);
+	this->spare = blocks;
+	if (!nr)
+		goto out;
+
+	// blocks of a segment share their rit and dst blocks
+	sort(blocks, nr, sizeof(struct stale_block), stale_block_cmp, NULL);
+	for (i = 0; i < nr; i++) {
+		cur = INF_ADDR;
+		jindisk->meta->rit->reset(jindisk->meta->rit, blocks[i].pba,
+					  blocks[i].lba, &cur);
+		if (cur == blocks[i].lba)
+			this->returned[nr_returned++] = blocks[i].pba;
+	}
+	jindisk->meta->dst->return_blocks(jindisk->meta->dst, this->returned,
+					  nr_returned);
+	disk_counter.stale_blocks += nr;
+out:
+	mutex_unlock(&this->drain_lock);
+}
+
+static void sa_drain_work(struct work_struct *ws)
+{
+	struct default_segment_allocator *this = container_of(
+		ws, struct default_segment_allocator, drain_work);
+
+	sa_drain(&this->segment_allocator);
+}
+
 int gc_one_segment(void)
 {
 	bool valid;
@@ -73,6 +168,8 @@ int gc_one_segment(void)
 	struct seg_validator *svt = jindisk->meta->seg_validator;
 	struct reverse_index_table *rit = jindisk->meta->rit;
 	struct lsm_tree *lsm_tree = jindisk->lsm_tree;
+	struct segment_allocator *sa = jindisk->seg_allocator;
+	struct segment_buffer *seg_buffer = jindisk->seg_buffer;
 
 	count = 0;
 	offset = 0;
@@ -81,6 +178,8 @@ int gc_one_segment(void)
 		DMERR("gc_one_segment kzalloc buffer failed");
 		return -ENOMEM;
 	}
+	// pick the victim by up to date block counts
+	sa->drain(sa);
 retry:
 	victim = dst->pop_victim(dst);
 	if (!victim) {
@@ -88,15 +187,20 @@ retry:
 		kfree(buffer);
 		return -ENODATA;
 	}
-	if (victim->nr_valid_block == 0) {
-		DMDEBUG("segment:%lu has no valid_block", victim->segno);
-		goto out;
-	}
 	if (victim->segno == dst->logging_segno) {
 		DMDEBUG("segment:%lu is threaded_logging, skip", victim->segno);
 		victim_destroy(victim);
 		goto retry;
 	}
+	if (!seg_buffer->gc_begin(seg_buffer, victim->segno)) {
+		DMDEBUG("segment:%lu is direct, skip", victim->segno);
+		victim_destroy(victim);
+		goto retry;
+	}
+	if (victim->nr_valid_block == 0) {
+		DMDEBUG("segment:%lu has no valid_block", victim->segno);
+		goto out;
+	}
 
 	DMDEBUG("gc segment:%lu", victim->segno);
 	do {
@@ -117,6 +221,9 @@ retry:
 			continue;
 		}
 		lsm_tree->put(lsm_tree, lba, NULL);
+		if (jindisk->data_cache)
+			jindisk->data_cache->invalidate(jindisk->data_cache,
+							lba);
 
 		jindisk_read_blocks(pba, 1, buffer, DM_IO_KMEM, NULL);
 		err = jindisk->cipher->decrypt(jindisk->cipher, buffer,
@@ -128,6 +235,8 @@ retry:
 			count++;
 		}
 	} while (++offset < BLOCKS_PER_SEGMENT);
+	// overwrites of its blocks logged while copying them
+	sa->drain(sa);
 out:
 	err = dst->return_segment(dst, victim->segno);
 	if (err)
@@ -135,6 +244,7 @@ out:
 	err = svt->test_and_return(svt, victim->segno, &valid);
 	if (err)
 		DMERR("clear SVT failed segment:%lu", victim->segno);
+	seg_buffer->gc_end(seg_buffer);
 
 	victim_destroy(victim);
 	kfree(buffer);
@@ -213,6 +323,11 @@ void sa_destroy(struct segment_allocator *al)
 		destroy_workqueue(gc_wq);
 
 	if (!IS_ERR_OR_NULL(this)) {
+		if (this->stale && this->spare && this->returned)
+			sa_drain(al);
+		kvfree(this->stale);
+		kvfree(this->spare);
+		kvfree(this->returned);
 		kfree(this);
 	}
 }
@@ -223,6 +338,8 @@ int sa_init(struct default_segment_allocator *this)
 
 	this->segment_allocator.alloc = sa_alloc;
 	this->segment_allocator.foreground_gc = sa_foreground_gc;
+	this->segment_allocator.invalidate = sa_invalidate;
+	this->segment_allocator.drain = sa_drain;
 	this->segment_allocator.destroy = sa_destroy;
 	this->segment_allocator.nr_valid_segment_get = sa_nr_valid_segment_get;
 	this->segment_allocator.nr_valid_segment_set = sa_nr_valid_segment_set;
@@ -233,6 +350,21 @@ int sa_init(struct default_segment_allocator *this)
 	if (err)
 		goto bad;
 
+	spin_lock_init(&this->stale_lock);
+	mutex_init(&this->drain_lock);
+	INIT_WORK(&this->drain_work, sa_drain_work);
+	this->stale = kvmalloc_array(STALE_LOG_SIZE, sizeof(struct stale_block),
+				     GFP_KERNEL);
+	this->spare = kvmalloc_array(STALE_LOG_SIZE, sizeof(struct stale_block),
+				     GFP_KERNEL);
+	this->returned =
+		kvmalloc_array(STALE_LOG_SIZE, sizeof(dm_block_t), GFP_KERNEL);
+	if (!this->stale || !this->spare || !this->returned) {
+		DMERR("alloc stale block log failed");
+		err = -ENOMEM;
+		goto bad;
+	}
+
 	gc_wq = alloc_workqueue("jindisk-gc", WQ_UNBOUND, 1);
 	if (!gc_wq) {
 		DMERR("alloc_workqueue gc_wq failed");
@@ -5,6 +5,10 @@
  */
 
 #include <linux/bio.h>
+#include <linux/hash.h>
+#include <linux/list_sort.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
 
 #include "../include/crypto.h"
 #include "../include/dm_jindisk.h"
@@ -15,22 +19,62 @@ struct bufferio_work {
 	struct work_struct work;
 	void *segbuf;
 	int index;
+	u64 ticket;
 };
 static struct workqueue_struct *bufferio_wq;
+static mempool_t *bufferio_work_pool;
+void bufferio_handler(struct work_struct *ws);
+
+/*
+ * Buffered blocks come from their own slabs, with enough reserved for the
+ * largest bio so that writes keep making progress under memory pressure.
+ */
+#define SEGBUF_RESERVED_BLOCKS MAX_NR_FETCH
+static struct kmem_cache *segment_block_cache;
+static struct kmem_cache *plain_block_cache;
+static mempool_t *segment_block_pool;
+static mempool_t *plain_block_pool;
+
+struct flush_chunk {
+	int nr;
+	dm_block_t start;
+	uint32_t lbas[FLUSH_CHUNK_BLOCKS];
+	struct record *records[FLUSH_CHUNK_BLOCKS];
+	struct aead_msg msgs[FLUSH_CHUNK_BLOCKS];
+	struct segment_flush *sf;
+	struct work_struct work;
+	struct completion done;
+	int error;
+};
+
+struct segment_flush {
+	void *cipher;
+	dm_block_t start;
+	int nr_chunk;
+	atomic_t nr_encrypting;
+	struct completion encrypted;
+	struct flush_chunk chunks[FLUSH_MAX_CHUNKS];
+};
+static struct workqueue_struct *encrypt_wq;
+static int segbuf_write_direct(struct default_segment_buffer *this,
+			       struct bio *bio);
+static int segbuf_direct_reserve(struct default_segment_buffer *this, int nr,
+				 dm_block_t *start);
 
 struct segment_block *segment_block_new(uint32_t lba)
 {
 	struct segment_block *blk =
-		kzalloc(sizeof(struct segment_block), GFP_KERNEL);
+		mempool_alloc(segment_block_pool, GFP_NOIO);
 	if (!blk) {
-		DMERR("segment_block_new kzalloc segment_block failed");
+		DMERR("segment_block_new alloc segment_block failed");
 		return NULL;
 	}
 	blk->lba = lba;
-	blk->plain_block = kzalloc(DATA_BLOCK_SIZE, GFP_KERNEL);
+	blk->logged = false;
+	blk->plain_block = mempool_alloc(plain_block_pool, GFP_NOIO);
 	if (!blk->plain_block) {
-		DMERR("segment_block_new kzalloc plain_block failed");
-		kfree(blk);
+		DMERR("segment_block_new alloc plain_block failed");
+		mempool_free(blk, segment_block_pool);
 		return NULL;
 	}
 	return blk;
@@ -39,8 +83,8 @@ struct segment_block *segment_block_new(uint32_t lba)
 void segment_block_delete(struct segment_block *blk)
 {
 	if (blk) {
-		kfree(blk->plain_block);
-		kfree(blk);
+		mempool_free(blk->plain_block, plain_block_pool);
+		mempool_free(blk, segment_block_pool);
 	}
 }
 int segment_block_cmp_key(const void *key, const struct rb_node *node)
@@ -76,18 +120,19 @@ int segment_block_cmp_node(struct rb_node *node, const struct rb_node *parent)
 	return (int64_t)nb->lba - (int64_t)pb->lba;
 }
 
-void data_segment_add(struct data_segment *ds, struct segment_block *blk)
+// returns the block of the same lba that blk replaced, if any
+struct segment_block *data_segment_add(struct data_segment *ds,
+				       struct segment_block *blk)
 {
 	struct rb_node *old;
-	struct segment_block *old_blk;
 
 	old = rb_find_add(&blk->node, &ds->root, segment_block_cmp_node);
 	if (old) {
-		old_blk = rb_entry(old, struct segment_block, node);
-		rb_erase(old, &ds->root);
-		segment_block_delete(old_blk);
-	} else
-		ds->size += 1;
+		rb_replace_node(old, &blk->node, &ds->root);
+		return rb_entry(old, struct segment_block, node);
+	}
+	ds->size += 1;
+	return NULL;
 }
 
 int data_segment_init(struct data_segment *ds)
@@ -95,20 +140,33 @@ int data_segment_init(struct data_segment *ds)
 	ds->size = 0;
 	ds->root = RB_ROOT;
 	get_random_bytes(ds->seg_key, sizeof(ds->seg_key));
-	ds->cipher_segment = vmalloc(SEGMENT_BUFFER_SIZE);
-	if (!ds->cipher_segment) {
-		DMERR("data_segment_init failed");
-		return -ENOMEM;
-	}
 	return 0;
 }
 
+static void segment_block_free_rcu(struct rcu_head *rcu)
+{
+	segment_block_delete(container_of(rcu, struct segment_block, rcu));
+}
+
+struct segbuf_reclaim {
+	struct rcu_work rwork;
+	struct rb_root root;
+};
+
+static void segbuf_reclaim_work(struct work_struct *ws)
+{
+	struct segbuf_reclaim *sr =
+		container_of(to_rcu_work(ws), struct segbuf_reclaim, rwork);
+	struct data_segment ds = { .root = sr->root };
+
+	data_segment_destroy(&ds);
+	kfree(sr);
+}
+
 void data_segment_destroy(struct data_segment *ds)
 {
 	struct segment_block *blk;
 
-	if (ds->cipher_segment)
-		vfree(ds->cipher_segment);
 	while (!RB_EMPTY_ROOT(&ds->root)) {
 		blk = rb_entry(rb_first(&ds->root), struct segment_block, node);
 		rb_erase(&blk->node, &ds->root);
@@ -118,12 +176,19 @@ void data_segment_destroy(struct data_segment *ds)
 
 int segbuf_push_bio(struct segment_buffer *buf, struct bio *bio)
 {
+	struct default_segment_buffer *this = container_of(
+		buf, struct default_segment_buffer, segment_buffer);
+	int err;
+
 #if defined(DEBUG)
 	dm_block_t start = bio_to_lba(bio);
 	int count = DIV_ROUND_UP(bio->bi_iter.bi_size, DATA_BLOCK_SIZE);
 
 	DMDEBUG("segbuf_push_bio start:%llu count:%d", start, count);
 #endif
+	err = segbuf_write_direct(this, bio);
+	if (err != -EAGAIN)
+		return err;
 	while (bio->bi_iter.bi_size) {
 		struct bio_vec bv = bio_iter_iovec(bio, bio->bi_iter);
 		dm_block_t lba = bio_to_lba(bio);
@@ -141,19 +206,250 @@ int segbuf_push_bio(struct segment_buffer *buf, struct bio *bio)
 	return 0;
 }
 
-void bufferio_handler(struct work_struct *ws)
+static u64 segbuf_stage_bit(dm_block_t lba)
 {
-	struct bufferio_work *bw = container_of(ws, struct bufferio_work, work);
-	struct segment_buffer *buf = bw->segbuf;
-	struct default_segment_buffer *this = container_of(
-		buf, struct default_segment_buffer, segment_buffer);
+	return BIT_ULL(hash_64(lba, 6));
+}
 
-	DMDEBUG("bufferio start index:%u", bw->index);
-	down_read(&this->rw_lock[bw->index]);
-	buf->flush_bios(buf, bw->index);
-	up_read(&this->rw_lock[bw->index]);
-	DMDEBUG("bufferio stop index:%u", bw->index);
-	kfree(bw);
+// called with stage->lock held
+static struct segment_block *segbuf_stage_get(struct segbuf_stage *stage,
+					      dm_block_t lba)
+{
+	struct segment_block *blk;
+
+	if (!(stage->filter & segbuf_stage_bit(lba)))
+		return NULL;
+	list_for_each_entry(blk, &stage->blocks, list) {
+		if (blk->lba == lba)
+			return blk;
+	}
+	return NULL;
+}
+
+static void segbuf_stage_detach(struct segbuf_stage *stage,
+				struct list_head *pending)
+{
+	spin_lock(&stage->lock);
+	list_splice_tail_init(&stage->blocks, pending);
+	stage->nr = 0;
+	WRITE_ONCE(stage->filter, 0);
+	spin_unlock(&stage->lock);
+}
+
+static void segbuf_stage_detach_all(struct default_segment_buffer *this,
+				    struct list_head *pending)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		segbuf_stage_detach(per_cpu_ptr(this->stages, cpu), pending);
+}
+
+// newest buffered block of lba, called with this->lock held
+static struct segment_block *
+segbuf_buffered_get(struct default_segment_buffer *this, dm_block_t lba)
+{
+	return xa_load(&this->index, lba);
+}
+
+/*
+ * Drop the blocks of a flushed buffer from the index and free them once
+ * lockless readers are done with them. Called with this->lock held.
+ */
+static void segbuf_reclaim(struct default_segment_buffer *this,
+			   struct data_segment *ds)
+{
+	struct segbuf_reclaim *sr;
+	struct segment_block *blk;
+
+	for (blk = rb_entry_safe(rb_first(&ds->root), struct segment_block,
+				 node);
+	     blk; blk = rb_entry_safe(rb_next(&blk->node),
+				      struct segment_block, node))
+		xa_cmpxchg(&this->index, blk->lba, blk, NULL, GFP_NOIO);
+
+	sr = kmalloc(sizeof(struct segbuf_reclaim), GFP_NOIO);
+	if (!sr) {
+		synchronize_rcu();
+		data_segment_destroy(ds);
+		return;
+	}
+	sr->root = ds->root;
+	ds->root = RB_ROOT;
+	INIT_RCU_WORK(&sr->rwork, segbuf_reclaim_work);
+	queue_rcu_work(bufferio_wq, &sr->rwork);
+}
+
+static bool segbuf_staged(struct default_segment_buffer *this, dm_block_t lba)
+{
+	struct segbuf_stage *stage;
+	bool staged;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(this->stages, cpu);
+		if (!(READ_ONCE(stage->filter) & segbuf_stage_bit(lba)))
+			continue;
+		spin_lock(&stage->lock);
+		staged = segbuf_stage_get(stage, lba) != NULL;
+		spin_unlock(&stage->lock);
+		if (staged)
+			return true;
+	}
+	return false;
+}
+
+static bool segbuf_next_clean(struct default_segment_buffer *this)
+{
+	int next = (READ_ONCE(this->cur_buffer) + 1) % this->nr_buffers;
+
+	return READ_ONCE(this->buffer[next].state) == SEGMENT_CLEAN;
+}
+
+static void segbuf_wait_clean(struct default_segment_buffer *this)
+{
+	u64 start;
+
+	if (segbuf_next_clean(this))
+		return;
+	start = ktime_get_ns();
+	wait_event(this->clean_wait, segbuf_next_clean(this));
+	disk_counter.write_stalls += 1;
+	disk_counter.write_stall_ns += ktime_get_ns() - start;
+}
+
+/*
+ * Hold back a writer about to merge into a nearly full buffer while the
+ * next one is still being flushed, before it takes this->lock, so that
+ * readers are not stuck behind a rotation waiting for the device.
+ */
+static void segbuf_throttle(struct default_segment_buffer *this, int nr)
+{
+	int cur = READ_ONCE(this->cur_buffer);
+
+	if (READ_ONCE(this->buffer[cur].size) + nr < BLOCKS_PER_SEGMENT)
+		return;
+	segbuf_wait_clean(this);
+}
+
+/*
+ * Queue the full current buffer for flushing and move on to the next one,
+ * once that has been flushed. Called with this->lock held for write.
+ */
+static void segbuf_rotate(struct default_segment_buffer *this)
+{
+	struct bufferio_work *bw;
+	int cur = this->cur_buffer;
+	struct data_segment *next;
+
+	bw = mempool_alloc(bufferio_work_pool, GFP_NOIO);
+	bw->segbuf = &this->segment_buffer;
+	bw->index = cur;
+	bw->ticket = atomic64_inc_return(&this->next_ticket) - 1;
+	INIT_WORK(&bw->work, bufferio_handler);
+	WRITE_ONCE(this->buffer[cur].state, SEGMENT_DIRTY);
+	queue_work(bufferio_wq, &bw->work);
+
+	segbuf_wait_clean(this);
+	this->cur_buffer = (cur + 1) % this->nr_buffers;
+	next = &this->buffer[this->cur_buffer];
+	if (next->size > 0)
+		segbuf_reclaim(this, next);
+	data_segment_init(next);
+	WRITE_ONCE(next->state, SEGMENT_FILLING);
+}
+
+static int segment_block_cmp_seq(void *priv, const struct list_head *a,
+				 const struct list_head *b)
+{
+	struct segment_block *ba = list_entry(a, struct segment_block, list);
+	struct segment_block *bb = list_entry(b, struct segment_block, list);
+
+	return ba->seq > bb->seq;
+}
+
+/*
+ * Merge pending blocks into the current segment in the order they were
+ * written, dropping those already superseded by a newer buffered copy.
+ * A rotation first drains every stage, so that no staged block outlives
+ * the buffer holding a newer copy of its lba.
+ * Called with this->lock held for write.
+ */
+static void segbuf_merge(struct default_segment_buffer *this,
+			 struct list_head *pending)
+{
+	struct segment_block *blk, *old;
+	struct data_segment *ds;
+
+	list_sort(NULL, pending, segment_block_cmp_seq);
+	while (!list_empty(pending)) {
+		blk = list_first_entry(pending, struct segment_block, list);
+		list_del(&blk->list);
+
+		old = segbuf_buffered_get(this, blk->lba);
+		if (old && old->seq > blk->seq) {
+			segment_block_delete(blk);
+			continue;
+		}
+		ds = &this->buffer[this->cur_buffer];
+		old = data_segment_add(ds, blk);
+		xa_store(&this->index, blk->lba, blk, GFP_NOIO | __GFP_NOFAIL);
+		if (old)
+			call_rcu(&old->rcu, segment_block_free_rcu);
+		if (ds->size < BLOCKS_PER_SEGMENT)
+			continue;
+
+		segbuf_rotate(this);
+		segbuf_stage_detach_all(this, pending);
+		list_sort(NULL, pending, segment_block_cmp_seq);
+	}
+}
+
+// copy a bio write into the stage of the local cpu
+static void segbuf_stage_block(struct default_segment_buffer *this,
+			       dm_block_t lba, void *buffer)
+{
+	struct segment_block *blk, *old;
+	struct segbuf_stage *stage;
+	LIST_HEAD(pending);
+	bool full;
+
+	blk = segment_block_new(lba);
+	memcpy(blk->plain_block, buffer, DATA_BLOCK_SIZE);
+
+	stage = get_cpu_ptr(this->stages);
+	spin_lock(&stage->lock);
+	blk->seq = atomic64_inc_return(&this->seq);
+	old = segbuf_stage_get(stage, lba);
+	if (old) {
+		DMDEBUG("segbuf_push_block from bio, lba:%llu "
+			"has old data, rewrite",
+			lba);
+		list_replace(&old->list, &blk->list);
+	} else {
+		list_add_tail(&blk->list, &stage->blocks);
+		WRITE_ONCE(stage->filter,
+			   stage->filter | segbuf_stage_bit(lba));
+		stage->nr += 1;
+	}
+	full = stage->nr >= SEGBUF_STAGE_BLOCKS;
+	spin_unlock(&stage->lock);
+	put_cpu_ptr(this->stages);
+
+	segment_block_delete(old);
+	if (jindisk->data_cache)
+		jindisk->data_cache->invalidate(jindisk->data_cache, lba);
+	DMDEBUG("segbuf_push_block lba:%llu write to stage", lba);
+	if (!full)
+		return;
+
+	segbuf_throttle(this, SEGBUF_STAGE_BLOCKS);
+	down_write(&this->lock);
+	write_seqcount_begin(&this->merge_seq);
+	segbuf_stage_detach(stage, &pending);
+	segbuf_merge(this, &pending);
+	write_seqcount_end(&this->merge_seq);
+	up_write(&this->lock);
 }
 
 void segbuf_push_block(struct segment_buffer *buf, dm_block_t lba, void *buffer,
@@ -161,52 +457,33 @@ void segbuf_push_block(struct segment_buffer *buf, dm_block_t lba, void *buffer,
 {
 	struct default_segment_buffer *this = container_of(
 		buf, struct default_segment_buffer, segment_buffer);
-	struct bufferio_work *bw = NULL;
-	struct segment_block *blk = NULL;
-	int cur, i, j;
+	struct segment_block *blk;
+	LIST_HEAD(pending);
 
-	down_write(&this->lock);
-	cur = this->cur_buffer;
-	if (rflag == false) {
-		for (i = 0; i < POOL_SIZE; i++) {
-			j = (cur + POOL_SIZE - i) % POOL_SIZE;
-			blk = data_segment_get(&this->buffer[j], lba);
-			if (blk) {
-				DMDEBUG("segbuf_push_block from gc, lba:%llu "
-					"has new data, skip",
-					lba);
-				up_write(&this->lock);
-				return;
-			}
-		}
-	} else {
-		blk = data_segment_get(&this->buffer[cur], lba);
-		if (blk)
-			DMDEBUG("segbuf_push_block from bio, lba:%llu "
-				"has old data, rewrite",
-				lba);
+	if (rflag) {
+		segbuf_stage_block(this, lba, buffer);
+		return;
 	}
 
-	if (!blk) {
-		blk = segment_block_new(lba);
-		data_segment_add(&this->buffer[cur], blk);
+	segbuf_throttle(this, 1);
+	down_write(&this->lock);
+	if (segbuf_buffered_get(this, lba) || segbuf_staged(this, lba)) {
+		DMDEBUG("segbuf_push_block from gc, lba:%llu "
+			"has new data, skip",
+			lba);
+		up_write(&this->lock);
+		return;
 	}
+	blk = segment_block_new(lba);
+	blk->seq = 0;
 	memcpy(blk->plain_block, buffer, DATA_BLOCK_SIZE);
+	if (jindisk->data_cache)
+		jindisk->data_cache->invalidate(jindisk->data_cache, lba);
 	DMDEBUG("segbuf_push_block lba:%llu write to buffer", lba);
-	if (this->buffer[cur].size >= BLOCKS_PER_SEGMENT) {
-		bw = kzalloc(sizeof(struct bufferio_work), GFP_KERNEL);
-		bw->segbuf = buf;
-		bw->index = cur;
-		INIT_WORK(&bw->work, bufferio_handler);
-		queue_work(bufferio_wq, &bw->work);
-
-		this->cur_buffer = (cur + 1) % POOL_SIZE;
-		down_write(&this->rw_lock[this->cur_buffer]);
-		if (this->buffer[this->cur_buffer].size > 0)
-			data_segment_destroy(&this->buffer[this->cur_buffer]);
-		data_segment_init(&this->buffer[this->cur_buffer]);
-		up_write(&this->rw_lock[this->cur_buffer]);
-	}
+	list_add_tail(&blk->list, &pending);
+	write_seqcount_begin(&this->merge_seq);
+	segbuf_merge(this, &pending);
+	write_seqcount_end(&this->merge_seq);
 	up_write(&this->lock);
 }
 
@@ -241,69 +518,675 @@ void segbuf_threaded_logging(struct data_segment *ds)
 
 		jindisk->lsm_tree->put(jindisk->lsm_tree, blk->lba, new);
 		jindisk->meta->rit->set(jindisk->meta->rit, pba, blk->lba);
+		if (jindisk->data_cache)
+			jindisk->data_cache->invalidate(jindisk->data_cache,
+							blk->lba);
 		jindisk_write_blocks(pba, 1, buffer, DM_IO_KMEM);
 	}
 	kfree(buffer);
 }
 
-void segbuf_flush_bios(struct segment_buffer *buf, int index)
+static void segbuf_wait_turn(struct default_segment_buffer *this, u64 ticket)
+{
+	wait_event(this->publish_wait, READ_ONCE(this->published) == ticket);
+}
+
+static void segbuf_end_turn(struct default_segment_buffer *this)
+{
+	smp_store_release(&this->published, this->published + 1);
+	wake_up_all(&this->publish_wait);
+}
+
+void flush_chunk_iocb(int error, void *context)
+{
+	struct flush_chunk *chunk = context;
+
+	chunk->error = error;
+	complete(&chunk->done);
+}
+
+/*
+ * Encrypt the blocks of a chunk into their place in the ciphertext buffer
+ * and start writing them. Chunks of a segment are encrypted on different
+ * cpus, each one is written as soon as it is encrypted. A chunk that
+ * failed to be prepared is not written and fails when published.
+ */
+void segbuf_encrypt_chunk(struct work_struct *ws)
+{
+	struct flush_chunk *chunk = container_of(ws, struct flush_chunk, work);
+	struct segment_flush *sf = chunk->sf;
+
+	if (!chunk->error)
+		jindisk->cipher->encrypt_many(jindisk->cipher, chunk->msgs,
+					      chunk->nr);
+	if (chunk->nr && !chunk->error)
+		jindisk_write_blocks_async(chunk->start, chunk->nr,
+					   (char *)sf->cipher +
+						   (chunk->start - sf->start) *
+							   DATA_BLOCK_SIZE,
+					   DM_IO_VMA, flush_chunk_iocb, chunk);
+	else
+		complete(&chunk->done);
+
+	if (atomic_dec_and_test(&sf->nr_encrypting))
+		complete(&sf->encrypted);
+}
+
+/*
+ * Take the next FLUSH_CHUNK_BLOCKS blocks from node on, assign them the
+ * pbas following the previous chunk and describe their encryption. A
+ * partial flush takes only blocks not logged yet.
+ */
+void segbuf_prepare_chunk(struct data_segment *ds, struct segment_flush *sf,
+			  struct flush_chunk *chunk, struct rb_node **node,
+			  bool partial)
+{
+	struct segment_block *blk;
+	dm_block_t pba;
+
+	chunk->nr = 0;
+	chunk->sf = sf;
+	chunk->error = 0;
+	init_completion(&chunk->done);
+	for (; *node && chunk->nr < FLUSH_CHUNK_BLOCKS;
+	     *node = rb_next(*node)) {
+		struct aead_msg *msg = &chunk->msgs[chunk->nr];
+		struct record *new;
+
+		blk = rb_entry(*node, struct segment_block, node);
+		if (partial && blk->logged)
+			continue;
+		pba = chunk->start + chunk->nr;
+		new = record_create(pba, ds->seg_key, NULL);
+		if (!new) {
+			// fail the whole chunk rather than lose a block quietly
+			chunk->error = -ENOMEM;
+			continue;
+		}
+
+		msg->data = blk->plain_block;
+		msg->out = (char *)sf->cipher +
+			   (pba - sf->start) * DATA_BLOCK_SIZE;
+		msg->len = DATA_BLOCK_SIZE;
+		msg->key = new->key;
+		msg->iv = NULL;
+		msg->mac = new->mac;
+		msg->seq = pba;
+		msg->done = NULL;
+		chunk->records[chunk->nr] = new;
+		chunk->lbas[chunk->nr] = blk->lba;
+		chunk->nr += 1;
+		if (partial)
+			blk->logged = true;
+	}
+}
+
+// publish the records of a chunk once it is on disk
+void segbuf_publish_chunk(struct default_segment_buffer *this,
+			  struct flush_chunk *chunk)
+{
+	int i;
+	dm_block_t lbas[FLUSH_CHUNK_BLOCKS];
+
+	wait_for_completion_io(&chunk->done);
+	if (chunk->error) {
+		for (i = 0; i < chunk->nr; i++)
+			record_destroy(chunk->records[i]);
+		DMERR("segment flush write failed pba:%llu count:%d err:%d",
+		      chunk->start, chunk->nr, chunk->error);
+		cmpxchg(&this->write_error, 0, chunk->error);
+		return;
+	}
+
+	// the blocks of a chunk are sorted by lba and have consecutive pbas
+	jindisk->lsm_tree->put_batch(jindisk->lsm_tree, chunk->lbas,
+				     chunk->records, chunk->nr);
+	for (i = 0; i < chunk->nr; i++)
+		lbas[i] = chunk->lbas[i];
+	jindisk->meta->rit->set_range(jindisk->meta->rit, chunk->start,
+				      chunk->nr, lbas);
+	/* drop fills that looked up the index before this put */
+	if (jindisk->data_cache) {
+		for (i = 0; i < chunk->nr; i++)
+			jindisk->data_cache->invalidate(jindisk->data_cache,
+							chunk->lbas[i]);
+	}
+}
+
+// count the blocks of a buffer a partial flush still has to log
+static size_t segbuf_unlogged(struct data_segment *ds)
 {
-	struct default_segment_buffer *this = container_of(
-		buf, struct default_segment_buffer, segment_buffer);
-	struct data_segment *ds = &this->buffer[index];
-	size_t count = ds->size;
-	struct record *new;
 	struct segment_block *blk;
 	struct rb_node *node;
-	dm_block_t start, pba;
-	int i = 0, err = 0;
+	size_t count = 0;
+
+	for (node = rb_first(&ds->root); node; node = rb_next(node)) {
+		blk = rb_entry(node, struct segment_block, node);
+		count += !blk->logged;
+	}
+	return count;
+}
 
+/*
+ * Flush buffer index to a newly allocated segment. The buffer is cut into
+ * chunks in pba order, which are spread over the online cpus to be
+ * encrypted and written. Their records are put to the index in pba order,
+ * each chunk only after its write completed and after all flushes with a
+ * smaller ticket were published. If walk_lock is given, it is held for
+ * read and released once the buffer has been encrypted.
+ *
+ * A partial flush of the buffer still being filled appends only its blocks
+ * not logged yet to the direct segment instead, in one sequential write,
+ * and leaves the whole segment to be written once the buffer is full.
+ */
+void segbuf_flush(struct default_segment_buffer *this, int index, u64 ticket,
+		  struct rw_semaphore *walk_lock, bool partial)
+{
+	struct data_segment *ds = &this->buffer[index];
+	size_t count = ds->size, segno = 0;
+	struct segment_flush *sf = NULL;
+	struct rb_node *node;
+	dm_block_t start;
+	int i, cpu, err = 0;
+
+	if (partial) {
+		mutex_lock(&this->log_lock);
+		count = segbuf_unlogged(ds);
+	}
 	if (!count)
-		return;
+		goto publish;
 
-	err = jindisk->seg_allocator->alloc(jindisk->seg_allocator,
-					    &ds->cur_segment);
+	if (partial) {
+		err = segbuf_direct_reserve(this, count, &start);
+		disk_counter.partial_log_blocks += count;
+	} else {
+		mutex_lock(&this->alloc_lock);
+		err = jindisk->seg_allocator->alloc(jindisk->seg_allocator,
+						    &segno);
+		mutex_unlock(&this->alloc_lock);
+		start = segno * BLOCKS_PER_SEGMENT;
+	}
 	if (err) {
+		if (partial)
+			mutex_unlock(&this->log_lock);
 		DMDEBUG("threaded_logging index:%u", index);
+		segbuf_wait_turn(this, ticket);
 		segbuf_threaded_logging(ds);
+		if (walk_lock)
+			up_read(walk_lock);
+		goto out;
+	}
+	sf = mempool_alloc(this->flush_pool, GFP_NOIO);
+	sf->cipher = mempool_alloc(this->cipher_pool, GFP_NOIO);
+	sf->start = start;
+	atomic_set(&sf->nr_encrypting, 1);
+	init_completion(&sf->encrypted);
+
+	cpu = raw_smp_processor_id();
+	node = rb_first(&ds->root);
+	for (i = 0; node && i < FLUSH_MAX_CHUNKS; i++) {
+		struct flush_chunk *chunk = &sf->chunks[i];
+
+		chunk->start = i ? sf->chunks[i - 1].start +
+					   sf->chunks[i - 1].nr :
+				   sf->start;
+		segbuf_prepare_chunk(ds, sf, chunk, &node, partial);
+		atomic_inc(&sf->nr_encrypting);
+		INIT_WORK(&chunk->work, segbuf_encrypt_chunk);
+		queue_work_on(cpu, encrypt_wq, &chunk->work);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	sf->nr_chunk = i;
+	if (!atomic_dec_and_test(&sf->nr_encrypting))
+		wait_for_completion(&sf->encrypted);
+publish:
+	if (partial)
+		mutex_unlock(&this->log_lock);
+	if (walk_lock)
+		up_read(walk_lock);
+	segbuf_wait_turn(this, ticket);
+	for (i = 0; sf && i < sf->nr_chunk; i++)
+		segbuf_publish_chunk(this, &sf->chunks[i]);
+	if (sf)
+		jindisk_journal_blocks(sf->start, count);
+out:
+	segbuf_end_turn(this);
+	if (sf) {
+		mempool_free(sf->cipher, this->cipher_pool);
+		mempool_free(sf, this->flush_pool);
+	}
+}
+
+static bool segbuf_queued(struct data_segment *ds)
+{
+	enum data_segment_state state = READ_ONCE(ds->state);
+
+	return state == SEGMENT_DIRTY || state == SEGMENT_FLUSHING;
+}
+
+static bool segbuf_direct_eligible(struct bio *bio)
+{
+	struct bvec_iter iter = bio->bi_iter;
+	struct bio_vec bv;
+
+	if (iter.bi_size < SEGBUF_DIRECT_MIN_BLOCKS * DATA_BLOCK_SIZE ||
+	    iter.bi_size > MAX_NR_FETCH * DATA_BLOCK_SIZE ||
+	    iter.bi_size % DATA_BLOCK_SIZE ||
+	    iter.bi_sector % SECTORS_PER_BLOCK)
+		return false;
+	// every block must sit in a page of its own
+	while (iter.bi_size) {
+		bv = bio_iter_iovec(bio, iter);
+		if (bv.bv_len < DATA_BLOCK_SIZE)
+			return false;
+		bio_advance_iter(bio, &iter, DATA_BLOCK_SIZE);
+	}
+	return true;
+}
+
+/*
+ * Reserve nr contiguous pbas in the direct segment, moving on to a new
+ * segment when the current one has no room. Blocks left at the end of the
+ * old segment are returned, so that gc does not keep them.
+ */
+static int segbuf_direct_reserve(struct default_segment_buffer *this, int nr,
+				 dm_block_t *start)
+{
+	struct dst *dst = jindisk->meta->dst;
+	size_t segno;
+	int err = 0;
+
+	mutex_lock(&this->alloc_lock);
+	if (this->direct_next + nr > this->direct_end) {
+		err = jindisk->seg_allocator->alloc(jindisk->seg_allocator,
+						    &segno);
+		if (err)
+			goto out;
+		for (; this->direct_next < this->direct_end;
+		     this->direct_next++)
+			dst->return_block(dst, this->direct_next);
+		this->direct_next = segno * BLOCKS_PER_SEGMENT;
+		this->direct_end = this->direct_next + BLOCKS_PER_SEGMENT;
+	}
+	*start = this->direct_next;
+	this->direct_next += nr;
+out:
+	mutex_unlock(&this->alloc_lock);
+	return err;
+}
+
+/*
+ * Buffered copies of the lbas of a direct write or discard must not be
+ * published after it. Merge their staged copies into the index and take
+ * those of the current buffer out of its tree onto detached, so that they
+ * are not flushed, but leave them in the index until it is published.
+ * Copies in queued buffers hold smaller tickets and are published before
+ * it. Returns the seq no older copy exceeds. Called with this->lock held
+ * for write.
+ */
+static u64 segbuf_detach_blocks(struct default_segment_buffer *this,
+				dm_block_t lba, int nr,
+				struct list_head *detached)
+{
+	u64 seq = atomic64_read(&this->seq);
+	struct segment_block *blk;
+	struct segbuf_stage *stage;
+	struct data_segment *ds;
+	LIST_HEAD(pending);
+	int i, cpu;
+
+	write_seqcount_begin(&this->merge_seq);
+	for (i = 0; i < nr; i++) {
+		for_each_possible_cpu(cpu) {
+			stage = per_cpu_ptr(this->stages, cpu);
+			if (!(READ_ONCE(stage->filter) &
+			      segbuf_stage_bit(lba + i)))
+				continue;
+			spin_lock(&stage->lock);
+			blk = segbuf_stage_get(stage, lba + i);
+			if (blk) {
+				list_move_tail(&blk->list, &pending);
+				stage->nr -= 1;
+			}
+			spin_unlock(&stage->lock);
+		}
+	}
+	segbuf_merge(this, &pending);
+	write_seqcount_end(&this->merge_seq);
+
+	// the merge may have rotated, so pick the buffer afterwards
+	ds = &this->buffer[this->cur_buffer];
+	for (i = 0; i < nr; i++) {
+		blk = data_segment_get(ds, lba + i);
+		if (blk) {
+			rb_erase(&blk->node, &ds->root);
+			ds->size -= 1;
+			list_add_tail(&blk->list, detached);
+		}
+	}
+	return seq;
+}
+
+/*
+ * Once a direct write or discard is published, drop the copies of its
+ * lbas not newer than seq from the index and free the detached ones. If
+ * the write failed, the detached copies still in the index go back to the
+ * current buffer instead. Called after the turn ended, as merging may
+ * wait for a flush to be published.
+ */
+static void segbuf_drop_blocks(struct default_segment_buffer *this,
+			       dm_block_t lba, int nr, u64 seq,
+			       struct list_head *detached, bool published)
+{
+	struct segment_block *blk, *tmp;
+	LIST_HEAD(pending);
+	int i;
+
+	down_write(&this->lock);
+	list_for_each_entry_safe(blk, tmp, detached, list) {
+		list_del(&blk->list);
+		if (!published && xa_load(&this->index, blk->lba) == blk)
+			list_add_tail(&blk->list, &pending);
+		else
+			call_rcu(&blk->rcu, segment_block_free_rcu);
+	}
+	if (!published) {
+		write_seqcount_begin(&this->merge_seq);
+		segbuf_merge(this, &pending);
+		write_seqcount_end(&this->merge_seq);
+		up_write(&this->lock);
 		return;
 	}
-	start = ds->cur_segment * BLOCKS_PER_SEGMENT;
-	for (node = rb_first(&ds->root); node; node = rb_next(node), i++) {
-		blk = rb_entry(node, struct segment_block, node);
+	for (i = 0; i < nr; i++) {
+		blk = xa_load(&this->index, lba + i);
+		if (blk && blk->seq <= seq)
+			xa_cmpxchg(&this->index, lba + i, blk, NULL, GFP_NOIO);
+	}
+	up_write(&this->lock);
+}
 
-		pba = start + i;
-		new = record_create(pba, ds->seg_key, NULL);
-		jindisk->cipher->encrypt(
-			jindisk->cipher, (char *)blk->plain_block,
-			DATA_BLOCK_SIZE, new->key, NULL, new->mac, new->pba,
-			(char *)(ds->cipher_segment) + i * DATA_BLOCK_SIZE);
-		jindisk->lsm_tree->put(jindisk->lsm_tree, blk->lba, new);
-		jindisk->meta->rit->set(jindisk->meta->rit, pba, blk->lba);
+/*
+ * Encrypt a large bio from its own pages into a run of pbas of the direct
+ * segment, skipping the buffers. Returns -EAGAIN if the bio has to take
+ * the buffered path.
+ */
+static int segbuf_write_direct(struct default_segment_buffer *this,
+			       struct bio *bio)
+{
+	dm_block_t lba = bio_to_lba(bio), start;
+	int i, nr = bio->bi_iter.bi_size / DATA_BLOCK_SIZE;
+	struct flush_chunk *chunk;
+	LIST_HEAD(detached);
+	u64 ticket, seq;
+	void *cipher;
+	int err;
+
+	if (!segbuf_direct_eligible(bio))
+		return -EAGAIN;
+
+	chunk = mempool_alloc(this->direct_pool, GFP_NOIO);
+	for (i = 0; i < nr; i++) {
+		chunk->records[i] = record_create(0, NULL, NULL);
+		if (!chunk->records[i])
+			goto bad;
 	}
-	jindisk_write_blocks(start, count, ds->cipher_segment, DM_IO_VMA);
+	down_read(&this->direct_lock);
+	if (segbuf_direct_reserve(this, nr, &start)) {
+		up_read(&this->direct_lock);
+		goto bad;
+	}
+
+	cipher = mempool_alloc(this->direct_cipher_pool, GFP_NOIO);
+	chunk->nr = nr;
+	chunk->start = start;
+	chunk->sf = NULL;
+	chunk->error = 0;
+	init_completion(&chunk->done);
+	for (i = 0; i < nr; i++) {
+		struct bio_vec bv = bio_iter_iovec(bio, bio->bi_iter);
+		struct aead_msg *msg = &chunk->msgs[i];
+		struct record *new = chunk->records[i];
+
+		new->pba = start + i;
+		msg->data = (char *)page_address(bv.bv_page) + bv.bv_offset;
+		msg->out = (char *)cipher + i * DATA_BLOCK_SIZE;
+		msg->len = DATA_BLOCK_SIZE;
+		msg->key = new->key;
+		msg->iv = NULL;
+		msg->mac = new->mac;
+		msg->seq = new->pba;
+		msg->done = NULL;
+		chunk->lbas[i] = lba + i;
+		bio_advance_iter(bio, &bio->bi_iter, DATA_BLOCK_SIZE);
+	}
+	disk_counter.write_req_blocks += nr;
+	disk_counter.direct_write_blocks += nr;
+
+	down_write(&this->lock);
+	seq = segbuf_detach_blocks(this, lba, nr, &detached);
+	ticket = atomic64_inc_return(&this->next_ticket) - 1;
+	up_write(&this->lock);
+
+	jindisk->cipher->encrypt_many(jindisk->cipher, chunk->msgs, nr);
+	jindisk_write_blocks_async(start, nr, cipher, DM_IO_VMA,
+				   flush_chunk_iocb, chunk);
+	segbuf_wait_turn(this, ticket);
+	segbuf_publish_chunk(this, chunk);
+	if (!chunk->error)
+		jindisk_journal_blocks(start, nr);
+	segbuf_end_turn(this);
+	segbuf_drop_blocks(this, lba, nr, seq, &detached, !chunk->error);
+	up_read(&this->direct_lock);
+
+	err = chunk->error;
+	mempool_free(cipher, this->direct_cipher_pool);
+	mempool_free(chunk, this->direct_pool);
+	return err;
+bad:
+	while (i--)
+		record_destroy(chunk->records[i]);
+	mempool_free(chunk, this->direct_pool);
+	return -EAGAIN;
 }
 
-int segbuf_query_block(struct segment_buffer *buf, uint32_t lba, void *data_out)
+/*
+ * Hold direct writes and discards off while gc relocates the blocks of segno,
+ * so that one published meanwhile is not undone by the relocated copy,
+ * and wait for the flushes started so far to be published. The direct
+ * segment is still being reserved and written, it is left alone.
+ */
+bool segbuf_gc_begin(struct segment_buffer *buf, size_t segno)
+{
+	struct default_segment_buffer *this =
+		container_of(buf, struct default_segment_buffer, segment_buffer);
+	bool pinned;
+	u64 ticket;
+
+	down_write(&this->direct_lock);
+	mutex_lock(&this->alloc_lock);
+	pinned = this->direct_end &&
+		 segno == (this->direct_end - 1) / BLOCKS_PER_SEGMENT;
+	mutex_unlock(&this->alloc_lock);
+	if (pinned) {
+		up_write(&this->direct_lock);
+		return false;
+	}
+
+	ticket = atomic64_read(&this->next_ticket);
+	wait_event(this->publish_wait,
+		   READ_ONCE(this->published) >= ticket);
+	return true;
+}
+
+void segbuf_gc_end(struct segment_buffer *buf)
+{
+	struct default_segment_buffer *this =
+		container_of(buf, struct default_segment_buffer, segment_buffer);
+
+	up_write(&this->direct_lock);
+}
+
+// unmap lba with a negative record, returning the block it was mapped to
+static void segbuf_unmap_block(dm_block_t lba)
+{
+	struct reverse_index_table *rit = jindisk->meta->rit;
+	struct dst *dst = jindisk->meta->dst;
+	struct record old;
+	dm_block_t cur_lba;
+	int err;
+
+	err = jindisk->lsm_tree->search(jindisk->lsm_tree, lba, &old);
+	if (err || old.pba == INF_ADDR)
+		return;
+	/*
+	 * lsm_tree_put returns the block itself if the old record was in the
+	 * memtable, the reset below then finds it taken already.
+	 */
+	jindisk->lsm_tree->put(jindisk->lsm_tree, lba, NULL);
+	err = rit->reset(rit, old.pba, lba, &cur_lba);
+	if (!err && cur_lba == lba)
+		dst->return_block(dst, old.pba);
+	if (jindisk->data_cache)
+		jindisk->data_cache->invalidate(jindisk->data_cache, lba);
+}
+
+/*
+ * Discard the whole blocks of a bio. Buffered copies are dropped as for a
+ * direct write, once the negative records are published in ticket order,
+ * so that copies in queued buffers cannot map the lbas again afterwards.
+ */
+int segbuf_discard_bio(struct segment_buffer *buf, struct bio *bio)
 {
 	struct default_segment_buffer *this = container_of(
 		buf, struct default_segment_buffer, segment_buffer);
-	struct segment_block *blk;
-	int i, j, index;
+	sector_t sector = bio->bi_iter.bi_sector;
+	dm_block_t lba, start, end;
+	LIST_HEAD(detached);
+	u64 ticket, seq;
 
-	down_read(&this->lock);
-	for (i = 0, j = this->cur_buffer + POOL_SIZE; i < POOL_SIZE; i++) {
-		index = (j - i) % POOL_SIZE;
+	start = DIV_ROUND_UP(sector, SECTORS_PER_BLOCK);
+	end = (sector + bio_sectors(bio)) / SECTORS_PER_BLOCK;
+	if (start >= end)
+		return 0;
 
-		blk = data_segment_get(&this->buffer[index], lba);
-		if (blk) {
+	// gc must not relocate the old copy of an lba unmapped meanwhile
+	down_read(&this->direct_lock);
+	down_write(&this->lock);
+	seq = segbuf_detach_blocks(this, start, end - start, &detached);
+	ticket = atomic64_inc_return(&this->next_ticket) - 1;
+	up_write(&this->lock);
+
+	segbuf_wait_turn(this, ticket);
+	for (lba = start; lba < end; lba++)
+		segbuf_unmap_block(lba);
+	segbuf_end_turn(this);
+	segbuf_drop_blocks(this, start, end - start, seq, &detached, true);
+	up_read(&this->direct_lock);
+	disk_counter.discard_blocks += end - start;
+	return 0;
+}
+
+/*
+ * Flush the current buffer directly. A buffer already queued is left to
+ * its handler and only waited for, clean buffers need nothing.
+ */
+void segbuf_flush_bios(struct segment_buffer *buf, int index)
+{
+	struct default_segment_buffer *this = container_of(
+		buf, struct default_segment_buffer, segment_buffer);
+	struct data_segment *ds = &this->buffer[index];
+	LIST_HEAD(pending);
+	u64 ticket;
+
+	// writes completed before the flush may still sit in a stage
+	down_write(&this->lock);
+	write_seqcount_begin(&this->merge_seq);
+	segbuf_stage_detach_all(this, &pending);
+	segbuf_merge(this, &pending);
+	write_seqcount_end(&this->merge_seq);
+	downgrade_write(&this->lock);
+	if (ds->state != SEGMENT_FILLING) {
+		up_read(&this->lock);
+		wait_event(this->clean_wait, !segbuf_queued(ds));
+		return;
+	}
+	ticket = atomic64_inc_return(&this->next_ticket) - 1;
+	segbuf_flush(this, index, ticket, &this->lock, true);
+}
+
+void bufferio_handler(struct work_struct *ws)
+{
+	struct bufferio_work *bw = container_of(ws, struct bufferio_work, work);
+	struct segment_buffer *buf = bw->segbuf;
+	struct default_segment_buffer *this = container_of(
+		buf, struct default_segment_buffer, segment_buffer);
+
+	DMDEBUG("bufferio start index:%u", bw->index);
+	WRITE_ONCE(this->buffer[bw->index].state, SEGMENT_FLUSHING);
+	segbuf_flush(this, bw->index, bw->ticket, NULL, false);
+	WRITE_ONCE(this->buffer[bw->index].state, SEGMENT_CLEAN);
+	wake_up_all(&this->clean_wait);
+	DMDEBUG("bufferio stop index:%u", bw->index);
+	mempool_free(bw, bufferio_work_pool);
+}
+
+/*
+ * Copy the newest buffered or staged copy of lba. The caller either holds
+ * this->lock or is inside rcu and checks merge_seq afterwards.
+ */
+static int segbuf_lookup(struct default_segment_buffer *this, uint32_t lba,
+			 void *data_out)
+{
+	struct segment_block *blk;
+	struct segbuf_stage *stage;
+	u64 seq = 0;
+	int cpu, err = -ENODATA;
+
+	blk = xa_load(&this->index, lba);
+	if (blk) {
+		memcpy(data_out, blk->plain_block, DATA_BLOCK_SIZE);
+		seq = blk->seq;
+		err = 0;
+	}
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(this->stages, cpu);
+		if (!(READ_ONCE(stage->filter) & segbuf_stage_bit(lba)))
+			continue;
+		spin_lock(&stage->lock);
+		blk = segbuf_stage_get(stage, lba);
+		if (blk && (err || blk->seq > seq)) {
 			memcpy(data_out, blk->plain_block, DATA_BLOCK_SIZE);
-			up_read(&this->lock);
-			return 0;
+			seq = blk->seq;
+			err = 0;
 		}
+		spin_unlock(&stage->lock);
+	}
+	return err;
+}
+
+int segbuf_query_block(struct segment_buffer *buf, uint32_t lba, void *data_out)
+{
+	struct default_segment_buffer *this = container_of(
+		buf, struct default_segment_buffer, segment_buffer);
+	unsigned int seq;
+	int err;
+
+	// a merge may sleep, so wait for it on the lock rather than spinning
+	seq = raw_read_seqcount(&this->merge_seq);
+	if (!(seq & 1)) {
+		rcu_read_lock();
+		err = segbuf_lookup(this, lba, data_out);
+		rcu_read_unlock();
+		if (!read_seqcount_retry(&this->merge_seq, seq))
+			return err;
 	}
+
+	down_read(&this->lock);
+	err = segbuf_lookup(this, lba, data_out);
 	up_read(&this->lock);
-	return -ENODATA;
+	return err;
 }
 
 void *segbuf_implementer(struct segment_buffer *buf)
@@ -313,58 +1196,218 @@ void *segbuf_implementer(struct segment_buffer *buf)
 	return this;
 }
 
+static void segbuf_mempools_destroy(void)
+{
+	mempool_destroy(bufferio_work_pool);
+	mempool_destroy(plain_block_pool);
+	mempool_destroy(segment_block_pool);
+	kmem_cache_destroy(plain_block_cache);
+	kmem_cache_destroy(segment_block_cache);
+	bufferio_work_pool = NULL;
+	plain_block_pool = NULL;
+	segment_block_pool = NULL;
+	plain_block_cache = NULL;
+	segment_block_cache = NULL;
+}
+
+static int segbuf_mempools_init(int nr_buffers)
+{
+	segment_block_cache = KMEM_CACHE(segment_block, 0);
+	if (!segment_block_cache)
+		goto bad;
+
+	plain_block_cache = kmem_cache_create("jindisk_plain_block",
+					      DATA_BLOCK_SIZE, DATA_BLOCK_SIZE,
+					      0, NULL);
+	if (!plain_block_cache)
+		goto bad;
+
+	segment_block_pool = mempool_create_slab_pool(SEGBUF_RESERVED_BLOCKS,
+						      segment_block_cache);
+	if (!segment_block_pool)
+		goto bad;
+
+	plain_block_pool = mempool_create_slab_pool(SEGBUF_RESERVED_BLOCKS,
+						    plain_block_cache);
+	if (!plain_block_pool)
+		goto bad;
+
+	bufferio_work_pool = mempool_create_kmalloc_pool(
+		nr_buffers, sizeof(struct bufferio_work));
+	if (!bufferio_work_pool)
+		goto bad;
+
+	return 0;
+bad:
+	DMERR("segbuf_mempools_init failed");
+	segbuf_mempools_destroy();
+	return -ENOMEM;
+}
+
+// pool_data is the size of the elements
+static void *segbuf_vmalloc_alloc(gfp_t gfp_mask, void *pool_data)
+{
+	return __vmalloc((unsigned long)pool_data, gfp_mask);
+}
+
+static void segbuf_vmalloc_free(void *element, void *pool_data)
+{
+	vfree(element);
+}
+
 void segbuf_destroy(struct segment_buffer *buf)
 {
 	int i;
 	struct default_segment_buffer *this = container_of(
 		buf, struct default_segment_buffer, segment_buffer);
+	LIST_HEAD(pending);
 
+	// merging the stages may rotate, so pick the buffer afterwards
+	down_write(&this->lock);
+	write_seqcount_begin(&this->merge_seq);
+	segbuf_stage_detach_all(this, &pending);
+	segbuf_merge(this, &pending);
+	write_seqcount_end(&this->merge_seq);
+	up_write(&this->lock);
 	buf->flush_bios(buf, this->cur_buffer);
 
+	// let deferred frees queue their reclaim work before draining it
+	rcu_barrier();
 	if (bufferio_wq)
 		destroy_workqueue(bufferio_wq);
+	if (encrypt_wq)
+		destroy_workqueue(encrypt_wq);
 
-	for (i = 0; i < POOL_SIZE; i++)
+	for (i = 0; i < this->nr_buffers; i++)
 		data_segment_destroy(&this->buffer[i]);
 
+	for (; this->direct_next < this->direct_end; this->direct_next++)
+		jindisk->meta->dst->return_block(jindisk->meta->dst,
+						 this->direct_next);
+	xa_destroy(&this->index);
+	kfree(this->buffer);
+	free_percpu(this->stages);
+	mempool_destroy(this->direct_cipher_pool);
+	mempool_destroy(this->direct_pool);
+	mempool_destroy(this->cipher_pool);
+	mempool_destroy(this->flush_pool);
+	segbuf_mempools_destroy();
 	kfree(this);
 }
 
-int segbuf_init(struct default_segment_buffer *buf)
+int segbuf_init(struct default_segment_buffer *buf, int nr_buffers)
 {
-	int i, err;
+	struct segbuf_stage *stage;
+	int cpu, i, err;
+
+	buf->nr_buffers = clamp(nr_buffers, MIN_POOL_SIZE, MAX_POOL_SIZE);
+	buf->buffer = kcalloc(buf->nr_buffers, sizeof(struct data_segment),
+			      GFP_KERNEL);
+	if (!buf->buffer)
+		return -ENOMEM;
 
-	bufferio_wq = alloc_workqueue("jindisk-buf", WQ_UNBOUND, 1);
+	err = segbuf_mempools_init(buf->nr_buffers);
+	if (err) {
+		kfree(buf->buffer);
+		return err;
+	}
+
+	// one flush of every buffer may be in flight
+	bufferio_wq = alloc_workqueue("jindisk-buf", WQ_UNBOUND,
+				      buf->nr_buffers);
 	if (!bufferio_wq) {
 		DMERR("alloc_workqueue jindisk-buf failed");
 		err = -EAGAIN;
 		goto bad;
 	}
+	encrypt_wq = alloc_workqueue("jindisk-enc",
+				     WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!encrypt_wq) {
+		DMERR("alloc_workqueue jindisk-enc failed");
+		err = -EAGAIN;
+		goto bad;
+	}
+	buf->flush_pool =
+		mempool_create(buf->nr_buffers, segbuf_vmalloc_alloc,
+			       segbuf_vmalloc_free,
+			       (void *)sizeof(struct segment_flush));
+	buf->cipher_pool =
+		mempool_create(buf->nr_buffers, segbuf_vmalloc_alloc,
+			       segbuf_vmalloc_free,
+			       (void *)(unsigned long)SEGMENT_BUFFER_SIZE);
+	buf->direct_pool = mempool_create_kmalloc_pool(
+		buf->nr_buffers, sizeof(struct flush_chunk));
+	buf->direct_cipher_pool =
+		mempool_create(buf->nr_buffers, segbuf_vmalloc_alloc,
+			       segbuf_vmalloc_free,
+			       (void *)(MAX_NR_FETCH * DATA_BLOCK_SIZE));
+	if (!buf->flush_pool || !buf->cipher_pool || !buf->direct_pool ||
+	    !buf->direct_cipher_pool) {
+		DMERR("segbuf_init mempool_create failed");
+		err = -ENOMEM;
+		goto bad;
+	}
+	buf->stages = alloc_percpu(struct segbuf_stage);
+	if (!buf->stages) {
+		DMERR("segbuf_init alloc_percpu failed");
+		err = -ENOMEM;
+		goto bad;
+	}
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(buf->stages, cpu);
+		spin_lock_init(&stage->lock);
+		stage->nr = 0;
+		stage->filter = 0;
+		INIT_LIST_HEAD(&stage->blocks);
+	}
+	atomic64_set(&buf->seq, 0);
+	xa_init(&buf->index);
+	seqcount_rwsem_init(&buf->merge_seq, &buf->lock);
+	atomic64_set(&buf->next_ticket, 0);
+	buf->published = 0;
+	init_waitqueue_head(&buf->publish_wait);
+	mutex_init(&buf->alloc_lock);
+	init_rwsem(&buf->direct_lock);
+	mutex_init(&buf->log_lock);
 	init_rwsem(&buf->lock);
-	for (i = 0; i < POOL_SIZE; i++)
-		init_rwsem(&buf->rw_lock[i]);
+	init_waitqueue_head(&buf->clean_wait);
 
 	buf->cur_buffer = 0;
-	err = data_segment_init(&buf->buffer[0]);
-	if (err)
-		goto bad;
+	for (i = 0; i < buf->nr_buffers; i++) {
+		err = data_segment_init(&buf->buffer[i]);
+		if (err)
+			goto bad;
+		buf->buffer[i].state = SEGMENT_CLEAN;
+	}
+	buf->buffer[0].state = SEGMENT_FILLING;
 
 	buf->segment_buffer.push_bio = segbuf_push_bio;
 	buf->segment_buffer.push_block = segbuf_push_block;
+	buf->segment_buffer.discard_bio = segbuf_discard_bio;
 	buf->segment_buffer.query_block = segbuf_query_block;
 	buf->segment_buffer.flush_bios = segbuf_flush_bios;
+	buf->segment_buffer.gc_begin = segbuf_gc_begin;
+	buf->segment_buffer.gc_end = segbuf_gc_end;
 	buf->segment_buffer.implementer = segbuf_implementer;
 	buf->segment_buffer.destroy = segbuf_destroy;
 	return 0;
 bad:
 	if (bufferio_wq)
 		destroy_workqueue(bufferio_wq);
+	if (encrypt_wq)
+		destroy_workqueue(encrypt_wq);
 
-	data_segment_destroy(&buf->buffer[0]);
+	free_percpu(buf->stages);
+	kfree(buf->buffer);
+	mempool_destroy(buf->direct_cipher_pool);
+	mempool_destroy(buf->direct_pool);
+	mempool_destroy(buf->cipher_pool);
+	mempool_destroy(buf->flush_pool);
+	segbuf_mempools_destroy();
 	return err;
 }
 
-struct segment_buffer *segbuf_create()
+struct segment_buffer *segbuf_create(int nr_buffers)
 {
 	int r;
 	struct default_segment_buffer *buf;
@@ -373,7 +1416,7 @@ struct segment_buffer *segbuf_create()
 	if (!buf)
 		return NULL;
 
-	r = segbuf_init(buf);
+	r = segbuf_init(buf, nr_buffers);
 	if (r)
 		return NULL;
 
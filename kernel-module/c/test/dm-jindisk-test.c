@@ -6,6 +6,7 @@
 
 #include <kunit/test.h>
 
+#include "../include/cache.h"
 #include "../include/lsm_tree.h"
 #include "../include/memtable.h"
 #include "../include/metadata.h"
@@ -38,6 +39,63 @@ void rbtree_memtable_test(struct kunit *test)
 	}
 }
 
+void skiplist_memtable_test(struct kunit *test)
+{
+	int i;
+	uint32_t last = 0;
+	struct entry entry;
+	struct iterator *iter;
+	struct memtable *memtable = skiplist_memtable_create(1 << 20);
+
+	KUNIT_ASSERT_NOT_NULL(test, memtable);
+	// put entry
+	for (i = 100; i >= 0; --i) {
+		memtable->put(memtable, i, record_create(i, NULL, NULL),
+			      record_destroy);
+	}
+
+	// overwrite entry, no concurrent gets to wait for
+	for (i = 100; i >= 0; --i) {
+		record_destroy(memtable->put(
+			memtable, i, record_create(100 - i, NULL, NULL),
+			record_destroy));
+	}
+	KUNIT_EXPECT_EQ(test, memtable->size, 101ul);
+
+	iter = memtable->iterator(memtable);
+	KUNIT_ASSERT_NOT_NULL(test, iter);
+	for (i = 0; iter->has_next(iter); i++) {
+		iter->next(iter, &entry);
+		if (i)
+			KUNIT_EXPECT_GT(test, entry.key, last);
+		KUNIT_EXPECT_EQ(test, 100 - entry.key,
+				((struct record *)(entry.val))->pba);
+		last = entry.key;
+	}
+	iter->destroy(iter);
+	KUNIT_EXPECT_EQ(test, i, 101);
+	memtable->destroy(memtable);
+}
+
+void skiplist_memtable_full_test(struct kunit *test)
+{
+	int i;
+	struct memtable *memtable =
+		skiplist_memtable_create(SKIPLIST_ARENA_SIZE);
+
+	KUNIT_ASSERT_NOT_NULL(test, memtable);
+	// negative records, no need to allocate one per entry
+	for (i = 0; i < DEFAULT_MEMTABLE_CAPACITY - 1; i++)
+		memtable->put(memtable, i, NULL, record_destroy);
+	KUNIT_EXPECT_FALSE(test, memtable->full(memtable));
+
+	memtable->put(memtable, i, NULL, record_destroy);
+	KUNIT_EXPECT_EQ(test, memtable->size,
+			(size_t)DEFAULT_MEMTABLE_CAPACITY);
+	KUNIT_EXPECT_TRUE(test, memtable->full(memtable));
+	memtable->destroy(memtable);
+}
+
 #define EXPECT_THRESHOLD(x, percent) ((x) / 100 * (percent))
 
 static void calc_avail_sectors_test(struct kunit *test)
@@ -76,9 +134,94 @@ void aes_cbc_cipher_test(struct kunit *test)
 	sc->destroy(sc);
 }
 
+void aes_gcm_cipher_test(struct kunit *test)
+{
+	int i;
+	char key[AES_GCM_KEY_SIZE];
+	char mac[2][AES_GCM_AUTH_SIZE];
+	struct aead_msg msgs[2] = { 0 };
+	struct aead_cipher *ac = aes_gcm_cipher_create();
+	char *ptext = kunit_kmalloc(test, 2 * DATA_BLOCK_SIZE, GFP_KERNEL);
+	char *ctext = kunit_kmalloc(test, 2 * DATA_BLOCK_SIZE, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, ac);
+	KUNIT_ASSERT_NOT_NULL(test, ptext);
+	KUNIT_ASSERT_NOT_NULL(test, ctext);
+	get_random_bytes(key, sizeof(key));
+	get_random_bytes(ptext, 2 * DATA_BLOCK_SIZE);
+	for (i = 0; i < 2; i++) {
+		msgs[i].data = ptext + i * DATA_BLOCK_SIZE;
+		msgs[i].out = ctext + i * DATA_BLOCK_SIZE;
+		msgs[i].len = DATA_BLOCK_SIZE;
+		msgs[i].key = key;
+		msgs[i].mac = mac[i];
+		msgs[i].seq = i;
+	}
+	KUNIT_EXPECT_EQ(test, ac->encrypt_many(ac, msgs, 2), 0);
+	KUNIT_EXPECT_NE(test, memcmp(ptext, ctext, DATA_BLOCK_SIZE), 0);
+
+	// decrypt in place, as reads do
+	for (i = 0; i < 2; i++)
+		msgs[i].data = msgs[i].out;
+	KUNIT_EXPECT_EQ(test, ac->decrypt_many(ac, msgs, 2), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(ptext, ctext, 2 * DATA_BLOCK_SIZE), 0);
+
+	// a corrupted mac fails its own block only
+	for (i = 0; i < 2; i++)
+		msgs[i].data = ptext + i * DATA_BLOCK_SIZE;
+	KUNIT_EXPECT_EQ(test, ac->encrypt_many(ac, msgs, 2), 0);
+	for (i = 0; i < 2; i++)
+		msgs[i].data = msgs[i].out;
+	mac[1][0] ^= 1;
+	KUNIT_EXPECT_EQ(test, ac->decrypt_many(ac, msgs, 2), -EBADMSG);
+	KUNIT_EXPECT_EQ(test, msgs[0].err, 0);
+	KUNIT_EXPECT_EQ(test, msgs[1].err, -EBADMSG);
+
+	ac->destroy(ac);
+}
+
+void twoq_cache_test(struct kunit *test)
+{
+	int i;
+	uint64_t gen;
+	char block[16] = { 0 };
+	struct block_cache *bc = twoq_cache_create(4, sizeof(block));
+
+	KUNIT_ASSERT_NOT_NULL(test, bc);
+	// fill A1in
+	for (i = 0; i < 4; i++) {
+		memset(block, i, sizeof(block));
+		bc->put(bc, i, block, bc->generation(bc, i));
+	}
+	KUNIT_EXPECT_EQ(test, bc->get(bc, 3, block), 0);
+	KUNIT_EXPECT_EQ(test, block[0], 3);
+
+	// a new block pushes the oldest one out to the ghost queue
+	bc->put(bc, 4, block, bc->generation(bc, 4));
+	KUNIT_EXPECT_NE(test, bc->get(bc, 0, block), 0);
+
+	// a ghost hit is promoted to Am and survives the next scan
+	bc->put(bc, 0, block, bc->generation(bc, 0));
+	for (i = 8; i < 16; i++)
+		bc->put(bc, i, block, bc->generation(bc, i));
+	KUNIT_EXPECT_EQ(test, bc->get(bc, 0, block), 0);
+
+	// a fill racing with an invalidation is dropped
+	gen = bc->generation(bc, 100);
+	bc->invalidate(bc, 100);
+	bc->put(bc, 100, block, gen);
+	KUNIT_EXPECT_NE(test, bc->get(bc, 100, block), 0);
+
+	bc->destroy(bc);
+}
+
 static struct kunit_case jindisk_test_cases[] = {
 	KUNIT_CASE(rbtree_memtable_test),
+	KUNIT_CASE(skiplist_memtable_test),
+	KUNIT_CASE(skiplist_memtable_full_test),
 	KUNIT_CASE(aes_cbc_cipher_test),
+	KUNIT_CASE(aes_gcm_cipher_test),
+	KUNIT_CASE(twoq_cache_test),
 	KUNIT_CASE(calc_avail_sectors_test);
 	{}
 };